@@ -2,29 +2,65 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <ctype.h>
+#include <errno.h>
 #include <omp.h>
-#include "uthash.h"
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "khash.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define CX_HAVE_MMAP 1
+#define CX_HAVE_PWRITE 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define CX_HAVE_IO_URING 1
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#endif
+#endif
+
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#endif
+
+// The vector kernels for other instruction sets than the build targets are compiled with
+// target attributes and picked at startup, so one binary runs the widest the host supports
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define CX_X86_DISPATCH 1
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#define CX_NEON 1
+#include <arm_neon.h>
+#endif
+
+// Generated by --build-dict-header; gives cx_default_dict and cx_default_dict_size
+#ifdef CX_EMBEDDED_DICT
+#include "cx_default_dict.h"
+#endif
 
 #define MAX_LINE 1024
 #define MAX_ENTRIES 100000
 
-bool symbol_lookup[256][256][256] = {{{ false }}};
-char* word_lookup[256][256][256] = {{{ NULL }}};
-unsigned char word_lookup_len[256][256][256] = {{{ 0 }}};
+#if defined(__GNUC__) || defined(__clang__)
+#define CX_PREFETCH(p) __builtin_prefetch(p)
+#else
+#define CX_PREFETCH(p) ((void)(p))
+#endif
 
 typedef struct {
     char* word;
     char* symbol;
 } DictEntry;
 
-typedef struct {
-    char* key;
-    char* value;
-    size_t value_len;
-    UT_hash_handle hh;
-} HashEntry;
-
 typedef struct {
     const char* start;
     size_t len;
@@ -37,12 +73,266 @@ typedef struct {
     bool is_space;
 } TokenSpan;
 
+// Class bits of each byte value. The delimiter set is defined here and nowhere else: both
+// is_delimiter() and the vector scanner below are derived from this table.
+#define CHAR_DELIMITER 1
+
+static const uint8_t char_class[256] = {
+    [' '] = CHAR_DELIMITER, [0] = CHAR_DELIMITER, [','] = CHAR_DELIMITER, ['.'] = CHAR_DELIMITER,
+    ['?'] = CHAR_DELIMITER, ['!'] = CHAR_DELIMITER, ['\n'] = CHAR_DELIMITER, ['\r'] = CHAR_DELIMITER,
+};
+
 // Helper function to check if character is a delimiter
 static inline bool is_delimiter(char c) {
-    return (c == ' ' || c == 0 || c == ',' || c == '.' ||
-            c == '?' || c == '!' || c == '\n' || c == '\r');
+    return char_class[(unsigned char)c] & CHAR_DELIMITER;
+}
+
+static inline int ctz64(uint64_t x) {
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_ctzll(x);
+#else
+    int n = 0;
+    while (!(x & 1)) { x >>= 1; n++; }
+    return n;
+#endif
+}
+
+// The transform kernels find word boundaries by classifying DELIMITER_BLOCK bytes at a time
+// into a bitmask (bit k set when byte k is a delimiter) and jumping between set and clear bits
+// with a trailing-zero count, instead of testing one byte per iteration. The vector classifiers
+// compare each block against every delimiter byte; init_delimiter_scan() lists those from
+// char_class and picks the classifier for the host. A set longer than DELIMITER_VECTOR_MAX, or a
+// host with none, leaves blocks classified through the table one byte at a time.
+#define DELIMITER_BLOCK 64
+#define DELIMITER_VECTOR_MAX 16
+
+typedef uint64_t (*DelimiterMaskFn)(const char* p);
+
+static struct {
+    // Each delimiter byte repeated across a block, ready to load as a compare operand
+    _Alignas(64) uint8_t splat[DELIMITER_VECTOR_MAX][DELIMITER_BLOCK];
+    // The delimiter bytes themselves, for the SSE4.2 string compare
+    _Alignas(16) uint8_t set[DELIMITER_VECTOR_MAX];
+    int count;
+    // Delimiter bitmask of p[0, DELIMITER_BLOCK); NULL when blocks are classified by table
+    DelimiterMaskFn mask;
+    const char* isa;
+} delimiter_scan;
+
+#ifdef CX_X86_DISPATCH
+__attribute__((target("sse2")))
+static uint64_t delimiter_mask_sse2(const char* p) {
+    __m128i v[4], match[4];
+    for (int k = 0; k < 4; k++) {
+        v[k] = _mm_loadu_si128((const __m128i*)(p + 16 * k));
+        match[k] = _mm_setzero_si128();
+    }
+    for (int d = 0; d < delimiter_scan.count; d++) {
+        __m128i delim = _mm_load_si128((const __m128i*)delimiter_scan.splat[d]);
+        for (int k = 0; k < 4; k++) match[k] = _mm_or_si128(match[k], _mm_cmpeq_epi8(v[k], delim));
+    }
+    uint64_t mask = 0;
+    for (int k = 0; k < 4; k++) mask |= (uint64_t)(uint16_t)_mm_movemask_epi8(match[k]) << (16 * k);
+    return mask;
+}
+
+// One explicit-length "equal any" string compare per 16 bytes matches the whole set at once,
+// NUL included
+__attribute__((target("sse4.2")))
+static uint64_t delimiter_mask_sse42(const char* p) {
+    __m128i set = _mm_load_si128((const __m128i*)delimiter_scan.set);
+    uint64_t mask = 0;
+    for (int k = 0; k < 4; k++) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(p + 16 * k));
+        __m128i match = _mm_cmpestrm(set, delimiter_scan.count, v, 16,
+                                     _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY | _SIDD_BIT_MASK);
+        mask |= (uint64_t)(uint16_t)_mm_cvtsi128_si32(match) << (16 * k);
+    }
+    return mask;
+}
+
+__attribute__((target("avx2")))
+static uint64_t delimiter_mask_avx2(const char* p) {
+    __m256i lo = _mm256_loadu_si256((const __m256i*)p);
+    __m256i hi = _mm256_loadu_si256((const __m256i*)(p + 32));
+    __m256i match_lo = _mm256_setzero_si256(), match_hi = _mm256_setzero_si256();
+    for (int d = 0; d < delimiter_scan.count; d++) {
+        __m256i delim = _mm256_load_si256((const __m256i*)delimiter_scan.splat[d]);
+        match_lo = _mm256_or_si256(match_lo, _mm256_cmpeq_epi8(lo, delim));
+        match_hi = _mm256_or_si256(match_hi, _mm256_cmpeq_epi8(hi, delim));
+    }
+    return (uint64_t)(uint32_t)_mm256_movemask_epi8(match_lo) |
+           (uint64_t)(uint32_t)_mm256_movemask_epi8(match_hi) << 32;
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static uint64_t delimiter_mask_avx512(const char* p) {
+    __m512i v = _mm512_loadu_si512((const void*)p);
+    uint64_t mask = 0;
+    for (int d = 0; d < delimiter_scan.count; d++) {
+        mask |= _mm512_cmpeq_epi8_mask(v, _mm512_load_si512((const void*)delimiter_scan.splat[d]));
+    }
+    return mask;
+}
+#endif
+
+#ifdef CX_NEON
+static uint64_t delimiter_mask_neon(const char* p) {
+    uint8x16_t v[4], match[4];
+    for (int k = 0; k < 4; k++) {
+        v[k] = vld1q_u8((const uint8_t*)p + 16 * k);
+        match[k] = vdupq_n_u8(0);
+    }
+    for (int d = 0; d < delimiter_scan.count; d++) {
+        uint8x16_t delim = vld1q_u8(delimiter_scan.splat[d]);
+        for (int k = 0; k < 4; k++) match[k] = vorrq_u8(match[k], vceqq_u8(v[k], delim));
+    }
+    // NEON has no movemask: weight each lane by its bit and add neighbouring lanes together
+    // until each byte of the low half holds the bits of eight consecutive lanes
+    static const uint8_t weights[16] = { 1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128 };
+    uint8x16_t bit = vld1q_u8(weights);
+    for (int k = 0; k < 4; k++) match[k] = vandq_u8(match[k], bit);
+    uint8x16_t sum = vpaddq_u8(vpaddq_u8(match[0], match[1]), vpaddq_u8(match[2], match[3]));
+    sum = vpaddq_u8(sum, sum);
+    return vgetq_lane_u64(vreinterpretq_u64_u8(sum), 0);
+}
+#endif
+
+// Kernels this build has, widest first
+static const char* const delimiter_isas[] = {
+#ifdef CX_X86_DISPATCH
+    "avx512", "avx2", "sse4.2", "sse2",
+#elif defined(CX_NEON)
+    "neon",
+#endif
+    "scalar",
+};
+
+// Pick the widest classifier the host runs. CX_ISA (scalar, sse2, sse4.2, avx2, avx512 or neon)
+// caps the choice, which is how the kernels are checked against each other. A name this build
+// has no kernel for is reported and ignored, so a typo can't quietly leave a run on scalar.
+static void select_delimiter_mask(void) {
+    const char* cap = getenv("CX_ISA");
+    if (cap && !*cap) cap = NULL;
+    if (cap) {
+        size_t known = sizeof(delimiter_isas) / sizeof(delimiter_isas[0]), k = 0;
+        while (k < known && strcmp(cap, delimiter_isas[k]) != 0) k++;
+        if (k == known) {
+            fprintf(stderr, "Ignoring CX_ISA=%s; this build has", cap);
+            for (k = 0; k < known; k++) fprintf(stderr, " %s", delimiter_isas[k]);
+            fprintf(stderr, "\n");
+            cap = NULL;
+        }
+    }
+    delimiter_scan.mask = NULL;
+    delimiter_scan.isa = "scalar";
+    if (!delimiter_scan.count || (cap && strcmp(cap, "scalar") == 0)) return;
+#ifdef CX_X86_DISPATCH
+    static const struct { const char* isa; DelimiterMaskFn mask; } kernels[] = {
+        { "avx512", delimiter_mask_avx512 }, { "avx2", delimiter_mask_avx2 },
+        { "sse4.2", delimiter_mask_sse42 }, { "sse2", delimiter_mask_sse2 },
+    };
+    __builtin_cpu_init();
+    bool supported[] = {
+        __builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512f"), __builtin_cpu_supports("avx2"),
+        __builtin_cpu_supports("sse4.2"), __builtin_cpu_supports("sse2"),
+    };
+    bool capped = cap != NULL;
+    for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+        if (capped && strcmp(cap, kernels[k].isa) != 0) continue;
+        capped = false;  // the named set and anything narrower
+        if (!supported[k]) continue;
+        delimiter_scan.mask = kernels[k].mask;
+        delimiter_scan.isa = kernels[k].isa;
+        return;
+    }
+#elif defined(CX_NEON)
+    delimiter_scan.mask = delimiter_mask_neon;
+    delimiter_scan.isa = "neon";
+#endif
+}
+
+static void init_delimiter_scan(void) {
+    int count = 0;
+    for (int c = 0; c < 256; c++) {
+        if (!(char_class[c] & CHAR_DELIMITER)) continue;
+        if (count == DELIMITER_VECTOR_MAX) {
+            count = 0;
+            break;
+        }
+        memset(delimiter_scan.splat[count], c, DELIMITER_BLOCK);
+        delimiter_scan.set[count++] = (uint8_t)c;
+    }
+    delimiter_scan.count = count;
+    select_delimiter_mask();
+}
+
+// Walks data[0, end) from boundary to boundary, keeping the bitmask of the block last classified
+typedef struct {
+    const char* data;
+    size_t end;
+    size_t base;  // the mask covers data[base, base + DELIMITER_BLOCK)
+    uint64_t mask;
+} DelimiterScanner;
+
+static inline void scanner_init(DelimiterScanner* scanner, const char* data, size_t end) {
+    scanner->data = data;
+    scanner->end = end;
+    scanner->base = end;  // nothing classified yet
+    scanner->mask = 0;
+}
+
+static inline void scanner_classify(DelimiterScanner* scanner, size_t pos) {
+    const char* p = scanner->data + pos;
+    size_t len = scanner->end - pos;
+    scanner->base = pos;
+    if (len >= DELIMITER_BLOCK && delimiter_scan.mask) {
+        scanner->mask = delimiter_scan.mask(p);
+        return;
+    }
+    // Past the end counts as a delimiter, so a token running into the end stops there
+    uint64_t mask = len < DELIMITER_BLOCK ? UINT64_MAX << len : 0;
+    if (len > DELIMITER_BLOCK) len = DELIMITER_BLOCK;
+    for (size_t k = 0; k < len; k++) mask |= (uint64_t)(char_class[(unsigned char)p[k]] & CHAR_DELIMITER) << k;
+    scanner->mask = mask;
+}
+
+// First position from pos on that is a delimiter (or, with `delimiter` false, is not one);
+// the end of the data when there is none
+static inline size_t scan_until(DelimiterScanner* scanner, size_t pos, bool delimiter) {
+    while (pos < scanner->end) {
+        if (pos - scanner->base >= DELIMITER_BLOCK) scanner_classify(scanner, pos);
+        uint64_t bits = (delimiter ? scanner->mask : ~scanner->mask) >> (pos - scanner->base);
+        if (bits) return pos + ctz64(bits);
+        pos = scanner->base + DELIMITER_BLOCK;
+    }
+    return scanner->end;
 }
 
+// The transform kernels work through a span TOKEN_BLOCK TokenSpans at a time. Tokenizing is a
+// stage of its own, run over the whole block before any token is looked up.
+#define TOKEN_BLOCK 128
+
+// Split data from *pos on into up to TOKEN_BLOCK spans, alternating runs of delimiters
+// (is_space) and tokens, and return how many; *pos ends after the last. Fewer than
+// TOKEN_BLOCK - 1 spans means the data holds no more.
+static size_t tokenize_block(DelimiterScanner* scanner, size_t* pos, TokenSpan* spans) {
+    size_t n = 0, i = *pos;
+    while (n < TOKEN_BLOCK - 1 && i < scanner->end) {
+        size_t token_start = scan_until(scanner, i, false);
+        if (token_start > i) spans[n++] = (TokenSpan){ .start = i, .len = token_start - i, .is_space = true };
+        if (token_start == scanner->end) {
+            i = token_start;
+            break;
+        }
+        i = scan_until(scanner, token_start, true);
+        spans[n++] = (TokenSpan){ .start = token_start, .len = i - token_start, .is_space = false };
+    }
+    *pos = i;
+    return n;
+}
+
+// Spans of all of input: delimiter runs and tokens, in order
 TokenSpan* tokenize(const char* input, size_t len, size_t* token_count_out) {
     size_t capacity = 1024;
     TokenSpan* spans = malloc(sizeof(TokenSpan) * capacity);
@@ -51,10 +341,12 @@ TokenSpan* tokenize(const char* input, size_t len, size_t* token_count_out) {
         exit(1);
     }
 
+    DelimiterScanner scanner;
+    scanner_init(&scanner, input, len);
     size_t i = 0, count = 0;
 
     while (i < len) {
-        if (count >= capacity) {
+        if (capacity - count < TOKEN_BLOCK) {
             capacity *= 2;
             spans = realloc(spans, sizeof(TokenSpan) * capacity);
             if (!spans) {
@@ -62,399 +354,3550 @@ TokenSpan* tokenize(const char* input, size_t len, size_t* token_count_out) {
                 exit(1);
             }
         }
-        if (is_delimiter(input[i])) {
-            spans[count++] = (TokenSpan){ .start = i, .len = 1, .is_space = true };
-            i++;
-        } else {
-            size_t j = i;
-            while (j < len && !is_delimiter(input[j])) {
-                j++;
-            }
-            spans[count++] = (TokenSpan){ .start = i, .len = j - i, .is_space = false };
-            i = j;
-        }
+        count += tokenize_block(&scanner, &i, spans + count);
     }
 
     *token_count_out = count;
     return spans;
 }
 
-bool is_symbol_fast(const char* word, size_t len) {
-    if (len == 0 || len > 3) return false;
-    unsigned char a = word[0];
-    unsigned char b = (len > 1) ? word[1] : 0;
-    unsigned char c = (len > 2) ? word[2] : 0;
-    return symbol_lookup[a][b][c];
+// Mark every byte an escape character must avoid: the input itself plus NUL and the
+// delimiters, since an escape that is also a delimiter would split the token it guards
+static void mark_used_chars(bool used[256], const char* buffer, size_t len) {
+    for (int c = 0; c < 256; c++) if (is_delimiter((char)c)) used[c] = true;
+    for (size_t i = 0; i < len; i++) used[(unsigned char)buffer[i]] = true;
 }
 
-DictEntry* load_dictionary(const char* dict_path, const char* lang_path, size_t* count, HashEntry** hashmap, const char mode) {
-    FILE* dict_file = fopen(dict_path, "r");
-    FILE* lang_file = fopen(lang_path, "r");
+// Returns 0 when every byte is taken
+static char pick_unused_char(const bool used[256]) {
+    for (int i = 0; i < 256; i++) if (!used[i]) return (char)i;
+    return 0;
+}
 
-    if (!dict_file || !lang_file) {
-        fprintf(stderr, "Failed to open dictionary (%s) or language file (%s)\n", dict_path, lang_path);
-        exit(1);
-    }
+char find_unused_char_from_buffer(const char* buffer, size_t len) {
+    bool used[256] = {0};
+    mark_used_chars(used, buffer, len);
+    char escape_char = pick_unused_char(used);
+    if (!escape_char) { fprintf(stderr, "No escape character available\n"); exit(1); }
+    return escape_char;
+}
 
-    DictEntry* entries = malloc(sizeof(DictEntry) * MAX_ENTRIES);
-    if (!entries) {
-        fprintf(stderr, "Memory allocation failed for dictionary\n");
-        exit(1);
+typedef struct {
+    char* data;
+    size_t len;
+    bool mapped;
+} InputFile;
+
+// Read an unseekable stream (pipe, socket, tty) into a growing heap buffer
+static char* read_stream(FILE* file, size_t* out_len) {
+    size_t capacity = 1 << 20;
+    size_t len = 0;
+    char* buffer = malloc(capacity + 1);
+    if (!buffer) { fprintf(stderr, "Memory allocation failed for input\n"); exit(1); }
+    size_t got;
+    while ((got = fread(buffer + len, 1, capacity - len, file)) > 0) {
+        len += got;
+        if (len == capacity) {
+            capacity *= 2;
+            buffer = realloc(buffer, capacity + 1);
+            if (!buffer) { fprintf(stderr, "Memory reallocation failed for input\n"); exit(1); }
+        }
     }
+    buffer[len] = '\0';
+    *out_len = len;
+    return buffer;
+}
 
-    char dict_line[MAX_LINE];
-    char lang_line[MAX_LINE];
-    size_t i = 0;
+// Map regular files read-only so compress()/decompress() work straight off the page cache
+// instead of a private copy; pipes and empty files fall back to read_stream().
+InputFile open_input(const char* path, const char* label) {
+    InputFile in = { NULL, 0, false };
+    FILE* file = fopen(path, "rb");
+    if (!file) { fprintf(stderr, "Failed to open %s file: %s\n", label, path); exit(1); }
 
-    while (fgets(dict_line, MAX_LINE, dict_file) && fgets(lang_line, MAX_LINE, lang_file)) {
-        dict_line[strcspn(dict_line, "\n")] = 0;
-        lang_line[strcspn(lang_line, "\n")] = 0;
-        if (strlen(dict_line) == 0 || strlen(lang_line) == 0) {
-            continue;
+#ifdef CX_HAVE_MMAP
+    struct stat st;
+    if (fstat(fileno(file), &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void* map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+        if (map != MAP_FAILED) {
+            madvise(map, (size_t)st.st_size, MADV_SEQUENTIAL);
+            fclose(file);
+            in.data = map;
+            in.len = (size_t)st.st_size;
+            in.mapped = true;
+            return in;
         }
+    }
+#endif
 
-        entries[i].word = strdup(dict_line);
-        entries[i].symbol = strdup(lang_line);
+    in.data = read_stream(file, &in.len);
+    fclose(file);
+    return in;
+}
 
-        HashEntry* item = malloc(sizeof(HashEntry));
-        if (mode == 'c') {
-            item->key = strdup(entries[i].word);
-            item->value = strdup(entries[i].symbol);
-            item->value_len = strlen(item->value);
-            size_t slen = strlen(entries[i].symbol);
-            if (slen <= 3) {
-                unsigned char a = entries[i].symbol[0];
-                unsigned char b = (slen > 1) ? entries[i].symbol[1] : 0;
-                unsigned char c = (slen > 2) ? entries[i].symbol[2] : 0;
-                symbol_lookup[a][b][c] = true;
-            }
-        } else {
-            item->key = strdup(entries[i].symbol);
-            item->value = strdup(entries[i].word);
-            item->value_len = strlen(item->value);
-
-            size_t slen = strlen(entries[i].symbol);
-            if (slen <= 3) {
-                unsigned char a = entries[i].symbol[0];
-                unsigned char b = (slen > 1) ? entries[i].symbol[1] : 0;
-                unsigned char c = (slen > 2) ? entries[i].symbol[2] : 0;
-                word_lookup[a][b][c] = entries[i].word;
-                word_lookup_len[a][b][c] = strlen(entries[i].word);
-            }
-        }
+// "-" names stdin or stdout, so CXcompress can sit in a pipeline next to zstd
+static bool is_std_stream(const char* path) {
+    return strcmp(path, "-") == 0;
+}
 
-        HASH_ADD_KEYPTR(hh, *hashmap, item->key, strlen(item->key), item);
-        i++;
+static void set_binary_mode(FILE* file) {
+#ifdef _WIN32
+    _setmode(_fileno(file), _O_BINARY);
+#else
+    (void)file;
+#endif
+}
+
+FILE* open_stream_input(const char* path) {
+    if (is_std_stream(path)) {
+        set_binary_mode(stdin);
+        return stdin;
     }
+    FILE* in = fopen(path, "rb");
+    if (!in) { fprintf(stderr, "Failed to open Input file: %s\n", path); exit(1); }
+    return in;
+}
 
-    fclose(dict_file);
-    fclose(lang_file);
+FILE* open_output(const char* path, const char* label) {
+    if (is_std_stream(path)) {
+        set_binary_mode(stdout);
+        return stdout;
+    }
+    FILE* out = fopen(path, "wb");
+    if (!out) { fprintf(stderr, "Failed to open %s output file: %s\n", label, path); exit(1); }
+    return out;
+}
 
-    *count = i;
-    return entries;
+// Flush and close an output stream, catching write errors such as a closed pipe or full disk
+void close_output(FILE* out) {
+    if (fflush(out) != 0 || ferror(out)) {
+        fprintf(stderr, "Failed to write output\n");
+        exit(1);
+    }
+    if (out != stdout) fclose(out);
 }
 
-void free_dictionary(DictEntry* entries, size_t count) {
-    for (size_t i = 0; i < count; i++) {
-        free(entries[i].word);
-        free(entries[i].symbol);
+// Output filled by several threads at once, each piece at its final offset. Regular files
+// get pwrite() from every thread; for stdout and platforms without pwrite() `fd` is -1 and
+// the caller writes the pieces in order through `file` instead.
+typedef struct {
+    FILE* file;
+    int fd;
+    bool failed;
+} ParallelOutput;
+
+ParallelOutput open_parallel_output(const char* path, const char* label) {
+    ParallelOutput out = { open_output(path, label), -1, false };
+#ifdef CX_HAVE_PWRITE
+    struct stat st;
+    if (out.file != stdout && fstat(fileno(out.file), &st) == 0 && S_ISREG(st.st_mode)) {
+        out.fd = fileno(out.file);
     }
-    free(entries);
+#endif
+    return out;
 }
 
-void free_hashmap(HashEntry* hashmap) {
-    HashEntry* current;
-    HashEntry* tmp;
-    HASH_ITER(hh, hashmap, current, tmp) {
-        HASH_DEL(hashmap, current);
-        free(current->key);
-        free(current->value);
-        free(current);
+// Write buf[0, len) at `offset` of a positional output; safe to call from several threads at once
+static void write_at(ParallelOutput* out, const void* buf, size_t len, uint64_t offset) {
+#ifdef CX_HAVE_PWRITE
+    const char* p = buf;
+    while (len > 0) {
+        ssize_t written = pwrite(out->fd, p, len, (off_t)offset);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            out->failed = true;
+            return;
+        }
+        p += written;
+        len -= (size_t)written;
+        offset += (uint64_t)written;
     }
+#else
+    (void)buf; (void)len; (void)offset;
+    out->failed = true;
+#endif
 }
 
-char find_unused_char_from_buffer(const char* buffer, size_t len) {
-    bool used[256] = {0};
-    used[0] = true;
-    for (size_t i = 0; i < len; i++) used[(unsigned char)buffer[i]] = true;
-    for (int i = 0; i < 256; i++) if (!used[i]) return (char)i;
-    fprintf(stderr, "No escape character available\n"); exit(1);
+// `total` is the final output size; positional writes leave the length to be set explicitly
+void close_parallel_output(ParallelOutput* out, uint64_t total) {
+    if (fflush(out->file) != 0) out->failed = true;
+#ifdef CX_HAVE_PWRITE
+    if (out->fd >= 0 && ftruncate(out->fd, (off_t)total) != 0) out->failed = true;
+#else
+    (void)total;
+#endif
+    if (out->failed) {
+        fprintf(stderr, "Failed to write output\n");
+        exit(1);
+    }
+    close_output(out->file);
 }
 
-char* read_file(const char* path, const char* label, size_t* out_len) {
-    FILE* file = fopen(path, "rb");
-    if (!file) { fprintf(stderr, "Failed to open %s file: %s\n", label, path); exit(1); }
-    fseek(file, 0, SEEK_END); long length = ftell(file); rewind(file);
-    char* buffer = malloc(length + 1);
-    size_t read = fread(buffer, 1, length, file);
-    buffer[read] = '\0';
-    fclose(file);
-    if (out_len) *out_len = read;
-    return buffer;
+void close_input(InputFile* in) {
+#ifdef CX_HAVE_MMAP
+    if (in->mapped) {
+        munmap(in->data, in->len);
+        in->data = NULL;
+        return;
+    }
+#endif
+    free(in->data);
+    in->data = NULL;
 }
 
-// Add this global (or pass it through) to match your decompression style
-char* compress_lookup[256][256][256] = {{{ NULL }}};
-unsigned char compress_lookup_len[256][256][256] = {{{ 0 }}};
+// Binary dictionary image, written by --build-dict: a header, the entry list, a minimal perfect
+// hash for each direction, the short-word indexes and a string pool, laid out so it can be used
+// in place straight from mmap with no parsing or allocation. Text dictionaries are turned into
+// the same image in memory, so every lookup goes through one code path.
+#define DICT_IMAGE_MAGIC "CXDI"
+#define DICT_IMAGE_VERSION 9
+// Images are used in place, so they only load on hosts with the byte order they were built on
+#define DICT_BYTE_ORDER 0x01020304u
+
+// Minimal perfect hash over the distinct words (or symbols), PTHash style: a key hashes to a
+// bucket, and the bucket's pilot moves it to one of position_count positions no other key uses.
+// Positions are searched with a little slack over key_count, which keeps the pilot search short;
+// the few keys landing past key_count are sent to the free slots below it through `remap`.
+// The slot names the key's entry, so a lookup is one probe and one compare to reject keys
+// outside the dictionary.
+typedef struct {
+    uint64_t pilots_offset;
+    uint64_t slots_offset;
+    uint64_t remap_offset;
+    uint64_t seed;
+    uint32_t key_count;
+    uint32_t bucket_count;
+    uint32_t position_count;
+    uint32_t reserved;
+} DictMphf;
 
-void compress(const char* dict_path, const char* lang_path, const char* input_buffer, size_t input_len, int threads, const char* output_path) {
-    size_t dict_size = 0;
-    HashEntry* hashmap = NULL;
-    // Load dict once
-    DictEntry* dict = load_dictionary(dict_path, lang_path, &dict_size, &hashmap, 'c');
-    char escape_char = find_unused_char_from_buffer(input_buffer, input_len);
+typedef struct {
+    uint64_t offset;
+    uint32_t mask;
+    uint32_t reserved;
+} DictPackedIndex;
+
+// Prefilter the compressor checks before probing for a word: a guard per length up to
+// PACKED_KEY_MAX with the smallest and largest leading 8 bytes (packed like the packed-table keys)
+// of the words that long, then a register-blocked Bloom filter over every distinct word, where a
+// key sets PREFILTER_HASHES bits of one 64-bit block, so a check is a single load. Most tokens
+// outside the dictionary stop there without touching the larger tables.
+#define PREFILTER_HASHES 4
+#define PREFILTER_BITS_PER_KEY 12
 
-    FILE* out = fopen(output_path, "wb");
-    fputc(escape_char, out);
+typedef struct {
+    uint64_t blocks_offset;
+    uint64_t guards_offset;
+    uint32_t block_mask;
+    uint32_t max_word_len;
+} DictPrefilter;
 
-    // Calculate split points exactly like your decompression function
-    size_t bytes_per_thread = (input_len + threads - 1) / threads;
-    size_t* split_points = malloc(sizeof(size_t) * (threads + 1));
-    split_points[0] = 0;
-    split_points[threads] = input_len;
+typedef struct {
+    uint64_t min;
+    uint64_t max;
+} DictLengthGuard;
 
-    for (int t = 1; t < threads; t++) {
-        size_t approx_pos = t * bytes_per_thread;
-        while (approx_pos < input_len && !is_delimiter(input_buffer[approx_pos])) {
-            approx_pos++;
-        }
-        split_points[t] = (approx_pos > input_len) ? input_len : approx_pos;
-    }
+// Double-array trie over the distinct words, for the --trie compressor, which matches a word
+// while scanning it. Byte c leads from node s to t = base[s] + c + 1 when check[t] == s; free
+// nodes have check TRIE_FREE, and the array is padded so every transition stays inside it. A
+// node where a word ends names the word's entry + 1 and carries a 1-3 byte symbol packed like a
+// short-symbol key (0 for longer ones).
+#define TRIE_FREE UINT32_MAX
 
-    char** segments = malloc(sizeof(char*) * threads);
-    size_t* seg_lens = calloc(threads, sizeof(size_t));
+typedef struct {
+    uint64_t nodes_offset;
+    uint64_t accept_offset;
+    uint32_t node_count;
+    uint32_t reserved;
+} DictTrie;
 
-    #pragma omp parallel num_threads(threads)
-    {
-        int tid = omp_get_thread_num();
-        size_t start_pos = split_points[tid];
-        size_t end_pos = split_points[tid + 1];
-
-        // Pre-allocate thread-local output buffer
-        char* buffer = malloc((end_pos - start_pos) * 2 + 1024);
-        size_t out_pos = 0;
-        size_t i = start_pos;
-
-        while (i < end_pos) {
-            // Handle delimiters (Spaces/Punctuation)
-            if (is_delimiter(input_buffer[i])) {
-                buffer[out_pos++] = input_buffer[i];
-                i++;
-                continue;
-            }
+typedef struct {
+    uint32_t base;
+    uint32_t check;
+} DictTrieNode;
 
-            // Identify word boundaries
-            size_t word_start = i;
-            while (i < end_pos && !is_delimiter(input_buffer[i])) {
-                i++;
-            }
-            size_t word_len = i - word_start;
-            const char* word_ptr = &input_buffer[word_start];
-
-            // FAST PATH: Use your 3D lookup for short words (1-3 chars)
-            bool found_fast = false;
-            if (word_len <= 3) {
-                unsigned char a = word_ptr[0];
-                unsigned char b = (word_len > 1) ? word_ptr[1] : 0;
-                unsigned char c = (word_len > 2) ? word_ptr[2] : 0;
-
-                // Note: You must populate a 'compress_lookup' table in load_dictionary
-                if (word_lookup[a][b][c]) {
-                    // ... implementation of O(1) jump ...
-                }
-            }
+typedef struct {
+    uint32_t entry;
+    uint32_t value;
+} DictTrieAccept;
 
-            if (!found_fast) {
-                // STACK ALLOCATION: No malloc inside this loop!
-                char temp[256];
-                size_t copy_len = (word_len < 255) ? word_len : 255;
-                memcpy(temp, word_ptr, copy_len);
-                temp[copy_len] = '\0';
-
-                HashEntry* found = NULL;
-                HASH_FIND_STR(hashmap, temp, found);
-
-                if (found) {
-                    memcpy(&buffer[out_pos], found->value, found->value_len);
-                    out_pos += found->value_len;
-                } else {
-                    // Check if the word itself looks like a symbol
-                    if (is_symbol_fast(temp, word_len)) {
-                        buffer[out_pos++] = escape_char;
-                    }
-                    memcpy(&buffer[out_pos], word_ptr, word_len);
-                    out_pos += word_len;
-                }
-            }
-        }
-        segments[tid] = buffer;
-        seg_lens[tid] = out_pos;
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t entry_count;
+    uint64_t image_size;
+    uint64_t entries_offset;
+    uint64_t pool_offset;
+    uint32_t pool_size;
+    uint32_t short_mask;
+    uint64_t short_table_offset;
+    DictMphf words;
+    DictMphf symbols;
+    DictPackedIndex words8;
+    DictPackedIndex words16;
+    DictPackedIndex symbols8;
+    DictPackedIndex symbols16;
+    DictPrefilter prefilter;
+    DictPackedIndex hot_words;
+    DictPackedIndex hot_symbols;
+    DictTrie trie;
+} DictImageHeader;
+
+// Offsets are into the pool, where every string is followed by a NUL. The pool holds all the
+// words and then all the symbols, each in dictionary (frequency) order, so the strings a
+// direction copies out sit together and the most used ones share a few cache lines.
+typedef struct {
+    uint32_t word_offset;
+    uint32_t word_len;
+    uint32_t symbol_offset;
+    uint32_t symbol_len;
+} DictImageEntry;
+
+// Slot of the short-symbol index: a 1-3 byte symbol packed with its length, and its entry
+// index + 1 in the low 24 bits of `entry`. A word of up to 8 bytes is also carried inline, with
+// its length in the top 8 bits of `entry`, so decompressing the common words never leaves the
+// slot. A packed key is never 0, so 0 marks an empty slot.
+#define SHORT_ENTRY_MASK 0xFFFFFFu
+#define SHORT_INLINE_MAX 8
+
+typedef struct {
+    uint32_t key;
+    uint32_t entry;
+    uint64_t word;
+} DictShortSlot;
+
+typedef struct {
+    const DictShortSlot* slots;
+    uint32_t mask;
+} ShortTable;
+
+// The HOT_WORDS most frequent words of up to PACKED_WORD_MAX bytes, and symbols of 1-3 bytes,
+// also get small tables of their own that stay in L1 and are checked before the full ones.
+// The dictionary lists words most frequent first, so its order is the ranking.
+#define HOT_WORDS 512
+
+// Keys of up to PACKED_KEY_MAX bytes are also indexed by their bytes packed into one or two
+// integers, zero-padded (tokens never hold a NUL, so the padding is unambiguous and a key is
+// never 0), in one table per key width and direction. Each is complete for its lengths, so a
+// lookup there is final and never hashes a byte string. A value of 1-3 bytes is carried in the
+// slot packed like a short-symbol key, so a hit emits it without touching the entry list or
+// pool; longer values leave `value` 0.
+#define PACKED_WORD_MAX 8
+#define PACKED_KEY_MAX 16
+
+typedef struct {
+    uint64_t key;
+    uint32_t entry;
+    uint32_t value;
+} DictPackedSlot;
+
+typedef struct {
+    uint64_t key[2];
+    uint32_t entry;
+    uint32_t value;
+} DictPacked16Slot;
+
+typedef struct {
+    const DictPackedSlot* slots;
+    uint32_t mask;
+} Packed8Table;
+
+typedef struct {
+    const DictPacked16Slot* slots;
+    uint32_t mask;
+} Packed16Table;
+
+typedef struct {
+    const uint32_t* pilots;
+    const uint32_t* slots;
+    const uint32_t* remap;
+    uint64_t seed;
+    uint32_t key_count;
+    uint32_t bucket_count;
+    uint32_t position_count;
+} MphfTable;
+
+// Once the tables a direction probes outgrow the last-level cache, its hash kernel adds a stage
+// between tokenizing a block and resolving it that packs the tokens' keys and prefetches the
+// slots they will probe, so those misses to memory overlap. Tables that stay cached gain
+// nothing from that (even a miss to L3 costs less than the extra pass), and their keys are
+// packed as each token is resolved. LOOKUP_BATCH_MIN_BYTES stands in where the cache size
+// isn't known.
+#define LOOKUP_BATCH_MIN_BYTES (8u << 20)
+
+typedef struct {
+    unsigned char* image;
+    size_t image_size;
+    bool mapped;
+    // Set for the image compiled into the binary, which is never freed
+    bool embedded;
+    const DictImageEntry* entries;
+    MphfTable words;
+    MphfTable symbols;
+    // Index of the 1-3 byte symbols, which make up most of the transformed text
+    ShortTable short_symbols;
+    // Hot tier for each direction
+    Packed8Table hot_words;
+    ShortTable hot_symbols;
+    // Words and symbols of up to PACKED_WORD_MAX and PACKED_KEY_MAX bytes (symbols from 4)
+    Packed8Table words8;
+    Packed16Table words16;
+    Packed8Table symbols8;
+    Packed16Table symbols16;
+    // Bloom filter blocks, and the guard for each word length
+    const uint64_t* prefilter;
+    const DictLengthGuard* guards;
+    uint32_t prefilter_mask;
+    uint32_t max_word_len;
+    const DictTrieNode* trie;
+    const DictTrieAccept* trie_accept;
+    uint32_t trie_nodes;
+    const char* pool;
+    uint32_t pool_size;
+    uint32_t entry_count;
+    // Whether the tables each direction probes outgrow the cache, so lookups are worth batching
+    bool batch_words;
+    bool batch_symbols;
+} Dictionary;
+
+static inline uint64_t mix64(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdull;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ull;
+    x ^= x >> 33;
+    return x;
+}
+
+static uint64_t dict_hash(const char* key, size_t len, uint64_t seed) {
+    uint64_t h = 14695981039346656037ull ^ seed;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)key[i];
+        h *= 1099511628211ull;
     }
+    return mix64(h);
+}
+
+// Two keys per bucket and 6% more positions than keys keep the pilot search to a few
+// milliseconds for the bundled dictionary, with the pilots still well inside L2
+static uint32_t mphf_bucket_count(uint32_t keys) {
+    return keys / 2 + 1;
+}
+
+static uint32_t mphf_position_count(uint32_t keys) {
+    return keys + keys / 16 + 1;
+}
+
+static inline uint32_t mphf_bucket(uint64_t h, uint32_t bucket_count) {
+    return (uint32_t)(((h >> 32) * bucket_count) >> 32);
+}
+
+static inline uint32_t mphf_position(uint64_t h, uint32_t pilot, uint32_t position_count) {
+    uint64_t x = mix64(h ^ (pilot * 0x9E3779B97F4A7C15ull));
+    return (uint32_t)(((x & 0xffffffffu) * position_count) >> 32);
+}
+
+// Find the entry whose word (or symbol, with by_symbol) is key[0, len); NULL when there is none
+static const DictImageEntry* dict_find(const Dictionary* dict, bool by_symbol, const char* key, size_t len) {
+    const MphfTable* table = by_symbol ? &dict->symbols : &dict->words;
+    if (table->key_count == 0) return NULL;
+    uint64_t h = dict_hash(key, len, table->seed);
+    uint32_t pilot = table->pilots[mphf_bucket(h, table->bucket_count)];
+    uint32_t position = mphf_position(h, pilot, table->position_count);
+    if (position >= table->key_count) position = table->remap[position - table->key_count];
+    const DictImageEntry* e = &dict->entries[table->slots[position]];
+    uint32_t offset = by_symbol ? e->symbol_offset : e->word_offset;
+    uint32_t elen = by_symbol ? e->symbol_len : e->word_len;
+    return elen == len && memcmp(dict->pool + offset, key, len) == 0 ? e : NULL;
+}
+
+static inline uint32_t pack_short_symbol(const char* s, size_t len) {
+    uint32_t key = (uint32_t)len << 24 | (unsigned char)s[0];
+    if (len > 1) key |= (uint32_t)(unsigned char)s[1] << 8;
+    if (len > 2) key |= (uint32_t)(unsigned char)s[2] << 16;
+    return key;
+}
+
+static inline uint32_t short_slot(uint32_t key, uint32_t mask) {
+    uint32_t h = key * 2654435761u;
+    return (h ^ h >> 16) & mask;
+}
 
-    for (int i = 0; i < threads; i++) {
-        fwrite(segments[i], 1, seg_lens[i], out);
-        free(segments[i]);
+// Slot for the symbol s[0, len) when it is 1-3 bytes long; NULL otherwise or when there is none
+static inline const DictShortSlot* short_symbol_slot(const ShortTable* table, const char* s, size_t len) {
+    if (len == 0 || len > 3) return NULL;
+    uint32_t key = pack_short_symbol(s, len);
+    for (uint32_t slot = short_slot(key, table->mask); table->slots[slot].key; slot = (slot + 1) & table->mask) {
+        if (table->slots[slot].key == key) return &table->slots[slot];
     }
+    return NULL;
+}
 
-    fclose(out);
-    free(segments);
-    free(seg_lens);
-    free_dictionary(dict, dict_size);
-    free_hashmap(hashmap);
+static inline const DictImageEntry* short_symbol_find(const Dictionary* dict, const char* s, size_t len) {
+    const DictShortSlot* slot = short_symbol_slot(&dict->short_symbols, s, len);
+    return slot ? &dict->entries[(slot->entry & SHORT_ENTRY_MASK) - 1] : NULL;
 }
 
-void decompress(const char* dict_path, const char* lang_path,
-                           const char* input_buffer, size_t input_len, int threads, const char* output_path) {
-    if (input_len < 1) return;
+static inline uint64_t pack_word(const char* s, size_t len) {
+    uint64_t key = 0;
+    memcpy(&key, s, len);
+    return key;
+}
 
-    size_t dict_size = 0;
-    HashEntry* hashmap = NULL;
-    DictEntry* dict = load_dictionary(lang_path, dict_path, &dict_size, &hashmap, 'd');
+// A key of up to PACKED_KEY_MAX bytes packed into two halves; `hi` is 0 for keys of up to
+// PACKED_WORD_MAX bytes. Packed once per token and shared by the prefilter and table probes.
+typedef struct {
+    uint64_t lo;
+    uint64_t hi;
+} PackedKey;
 
-    char escape_char = input_buffer[0];
-    const char* data = input_buffer + 1;
-    size_t data_len = input_len - 1;
+static inline PackedKey pack_key(const char* s, size_t len) {
+    if (len <= PACKED_WORD_MAX) return (PackedKey){ pack_word(s, len), 0 };
+    return (PackedKey){ pack_word(s, PACKED_WORD_MAX), pack_word(s + PACKED_WORD_MAX, len - PACKED_WORD_MAX) };
+}
 
-    FILE* out = fopen(output_path, "wb");
-    if (!out) {
-        fprintf(stderr, "Failed to open decompressed output file: %s\n", output_path);
-        exit(1);
+// pack_word() for a key with at least 8 readable bytes at s: one fixed-size load and a mask
+// instead of a variable-length copy
+static inline uint64_t pack_word_wide(const char* s, size_t len) {
+    uint64_t key;
+    memcpy(&key, s, 8);
+    if (len >= 8) return key;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    return key & ~(UINT64_MAX >> (8 * len));
+#else
+    return key & ((1ull << (8 * len)) - 1);
+#endif
+}
+
+// pack_key() for a key followed by at least `readable` bytes of the same buffer (counting its own)
+static inline PackedKey pack_key_within(const char* s, size_t len, size_t readable) {
+    if (readable < PACKED_KEY_MAX) return pack_key(s, len);
+    if (len <= PACKED_WORD_MAX) return (PackedKey){ pack_word_wide(s, len), 0 };
+    return (PackedKey){ pack_word_wide(s, PACKED_WORD_MAX),
+                        pack_word_wide(s + PACKED_WORD_MAX, len - PACKED_WORD_MAX) };
+}
+
+static inline uint32_t packed_slot(uint64_t key, uint32_t mask) {
+    uint64_t h = key * 0x9E3779B97F4A7C15ull;
+    return (uint32_t)(h ^ h >> 32) & mask;
+}
+
+static inline uint32_t packed16_slot(uint64_t lo, uint64_t hi, uint32_t mask) {
+    uint64_t h = lo * 0x9E3779B97F4A7C15ull ^ hi * 0xC2B2AE3D27D4EB4Full;
+    return (uint32_t)(h ^ h >> 32) & mask;
+}
+
+// Slot for a key of 1..PACKED_WORD_MAX bytes; NULL when it isn't in the table
+static inline const DictPackedSlot* packed8_find(const Packed8Table* table, PackedKey key) {
+    for (uint32_t slot = packed_slot(key.lo, table->mask); table->slots[slot].key; slot = (slot + 1) & table->mask) {
+        if (table->slots[slot].key == key.lo) return &table->slots[slot];
     }
+    return NULL;
+}
 
-    size_t bytes_per_thread = (data_len + threads - 1) / threads;
+// Slot for a key of PACKED_WORD_MAX+1..PACKED_KEY_MAX bytes; NULL when it isn't in the table
+static inline const DictPacked16Slot* packed16_find(const Packed16Table* table, PackedKey key) {
+    for (uint32_t slot = packed16_slot(key.lo, key.hi, table->mask); table->slots[slot].key[0];
+         slot = (slot + 1) & table->mask) {
+        if (table->slots[slot].key[0] == key.lo && table->slots[slot].key[1] == key.hi) return &table->slots[slot];
+    }
+    return NULL;
+}
 
-    size_t* split_points = malloc(sizeof(size_t) * (threads + 1));
-    split_points[0] = 0;
-    split_points[threads] = data_len;
-
-    for (int t = 1; t < threads; t++) {
-        size_t approx_pos = t * bytes_per_thread;
-        if (approx_pos >= data_len) {
-            for (int remaining = t; remaining <= threads; remaining++) {
-                split_points[remaining] = data_len;
-            }
-            threads = t;
-            break;
-        }
+// Copy a value packed like a short-symbol key to buffer
+static inline size_t emit_packed_value(char* buffer, size_t room, uint32_t value) {
+    size_t len = value >> 24;
+#if !defined(__BYTE_ORDER__) || __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    // The value's bytes sit in memory order below its length byte, so one store writes them all
+    if (room >= sizeof(value)) {
+        memcpy(buffer, &value, sizeof(value));
+        return len;
+    }
+#endif
+    (void)room;
+    buffer[0] = (char)value;
+    if (len > 1) buffer[1] = (char)(value >> 8);
+    if (len > 2) buffer[2] = (char)(value >> 16);
+    return len;
+}
 
-        while (approx_pos < data_len && !is_delimiter(data[approx_pos])) {
-            approx_pos++;
-        }
-        split_points[t] = approx_pos;
+// Strings the kernels emit are nearly all shorter than COPY_WIDE bytes. Rather than a memcpy of
+// the exact length, which is a library call and a dispatch on the length, they are copied with
+// one fixed load and store of COPY_WIDE (or twice that) bytes whenever the source has that many
+// readable bytes and the destination that much room. The bytes stored past the string are
+// overwritten by the next write; a span's caller only keeps what it reports as written.
+#define COPY_WIDE 16
+
+// Copy src[0, len) to dst, where `room` bytes may be written and `readable` bytes read
+static inline void copy_short(char* dst, size_t room, const char* src, size_t readable, size_t len) {
+    if (len <= COPY_WIDE && room >= COPY_WIDE && readable >= COPY_WIDE) {
+        memcpy(dst, src, COPY_WIDE);
+    } else if (len <= 2 * COPY_WIDE && room >= 2 * COPY_WIDE && readable >= 2 * COPY_WIDE) {
+        memcpy(dst, src, 2 * COPY_WIDE);
+    } else {
+        memcpy(dst, src, len);
     }
+}
 
-    char** segments = malloc(sizeof(char*) * threads);
-    size_t* seg_lens = calloc(threads, sizeof(size_t));
+// `key` is the packing of s[0, len) when it is at most PACKED_KEY_MAX bytes long
+static inline uint64_t prefilter_hash(const char* s, size_t len, PackedKey key) {
+    if (len <= PACKED_KEY_MAX) return (key.lo ^ key.hi * 0xC2B2AE3D27D4EB4Full) * 0x9E3779B97F4A7C15ull;
+    return dict_hash(s, len, 0);
+}
 
-    #pragma omp parallel num_threads(threads)
-    {
-        int tid = omp_get_thread_num();
-        size_t start_pos = split_points[tid];
-        size_t end_pos = split_points[tid + 1];
-
-        char* buffer = malloc((end_pos - start_pos) * 4 + 1024);
-        size_t out_pos = 0;
-        size_t i = start_pos;
-
-        while (i < end_pos) {
-            if (is_delimiter(data[i])) {
-                buffer[out_pos++] = data[i];
-                i++;
-                continue;
-            }
+// The block a key hashing to h falls in takes the high bits of h; the bits it sets take the low
+// bits once the high half is folded in
+static inline uint32_t prefilter_block(uint64_t h, uint32_t mask) {
+    return (uint32_t)(h >> 40) & mask;
+}
 
-            size_t token_start = i;
-            while (i < end_pos && !is_delimiter(data[i])) {
-                i++;
-            }
+static inline uint64_t prefilter_bits(uint64_t h) {
+    uint32_t bits = (uint32_t)(h ^ h >> 32);
+    uint64_t mask = 0;
+    for (int i = 0; i < PREFILTER_HASHES; i++) mask |= 1ull << (bits >> (6 * i) & 63);
+    return mask;
+}
 
-            size_t token_len = i - token_start;
-            const char* token_ptr = &data[token_start];
+// False when the word s[0, len), packed as `key`, is certainly not in the dictionary
+static inline bool prefilter_may_contain(const Dictionary* dict, const char* s, size_t len, PackedKey key) {
+    if (len > dict->max_word_len) return false;
+    if (len <= PACKED_KEY_MAX && (key.lo < dict->guards[len].min || key.lo > dict->guards[len].max)) return false;
+    uint64_t h = prefilter_hash(s, len, key);
+    uint64_t bits = prefilter_bits(h);
+    return (dict->prefilter[prefilter_block(h, dict->prefilter_mask)] & bits) == bits;
+}
 
-            bool is_escaped = (token_ptr[0] == escape_char);
-            const char* actual_token = is_escaped ? token_ptr + 1 : token_ptr;
-            size_t actual_len = token_len - (is_escaped ? 1 : 0);
+// Whether a literal of 1-3 bytes would read back as a symbol and so needs the escape
+static inline bool is_symbol_fast(const Dictionary* dict, const char* word, size_t len) {
+    return short_symbol_find(dict, word, len) != NULL;
+}
 
-            if (!is_escaped && actual_len <= 3) {
-                unsigned char a = actual_token[0];
-                unsigned char b = (actual_len > 1) ? actual_token[1] : 0;
-                unsigned char c = (actual_len > 2) ? actual_token[2] : 0;
-                char* replacement = word_lookup[a][b][c];
+static size_t align8(size_t n) {
+    return (n + 7) & ~(size_t)7;
+}
 
-                if (replacement) {
-                    size_t repl_len = word_lookup_len[a][b][c];
-                    memcpy(&buffer[out_pos], replacement, repl_len);
-                    out_pos += repl_len;
-                    continue;
-                }
-            }
+// Place a section of `bytes` at the 8-aligned end of the image laid out so far
+static uint64_t reserve_section(uint64_t* cursor, uint64_t bytes) {
+    uint64_t offset = *cursor;
+    *cursor = align8(offset + bytes);
+    return offset;
+}
 
-            if (!is_escaped) {
-                char* temp_token = malloc(actual_len + 1);
-                memcpy(temp_token, actual_token, actual_len);
-                temp_token[actual_len] = '\0';
+static const char* entry_key(const DictImageEntry* e, const char* pool, bool by_symbol, uint32_t* len) {
+    *len = by_symbol ? e->symbol_len : e->word_len;
+    return pool + (by_symbol ? e->symbol_offset : e->word_offset);
+}
 
-                HashEntry* found = NULL;
-                HASH_FIND_STR(hashmap, temp_token, found);
+// Pool strings are NUL-terminated, so the image builder can dedupe them with khash's string maps
+KHASH_MAP_INIT_STR(key_index, uint32_t)
 
-                if (found) {
-                    memcpy(&buffer[out_pos], found->value, found->value_len);
-                    out_pos += found->value_len;
-                    free(temp_token);
-                    continue;
-                }
-                free(temp_token);
-            }
+static int compare_u32(const void* a, const void* b) {
+    uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+    return (x > y) - (x < y);
+}
 
-            memcpy(&buffer[out_pos], actual_token, actual_len);
-            out_pos += actual_len;
+// Indexes of the entries whose word (or symbol) is distinct, in dictionary order; a repeated key
+// keeps its later definition
+static uint32_t* unique_keys(const DictImageEntry* entries, const char* pool, uint32_t count, bool by_symbol,
+                             uint32_t* unique_count) {
+    khash_t(key_index)* seen = kh_init(key_index);
+    uint32_t* keys = malloc(sizeof(uint32_t) * (count ? count : 1));
+    if (!seen || !keys || kh_resize(key_index, seen, count) < 0) {
+        fprintf(stderr, "Memory allocation failed for dictionary\n");
+        exit(1);
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t len;
+        int ret;
+        khiter_t it = kh_put(key_index, seen, entry_key(&entries[i], pool, by_symbol, &len), &ret);
+        if (ret < 0) {
+            fprintf(stderr, "Memory allocation failed for dictionary\n");
+            exit(1);
         }
+        kh_value(seen, it) = i;
+    }
+    uint32_t n = 0;
+    for (khiter_t it = kh_begin(seen); it != kh_end(seen); ++it) {
+        if (kh_exist(seen, it)) keys[n++] = kh_value(seen, it);
+    }
+    kh_destroy(key_index, seen);
+    qsort(keys, n, sizeof(uint32_t), compare_u32);
+    *unique_count = n;
+    return keys;
+}
+
+// Tables are at most half full, so probes stay short and always reach an empty slot
+static uint32_t packed_slot_count(uint32_t keys) {
+    uint32_t slots = 16;
+    while (slots < (uint64_t)keys * 2) slots <<= 1;
+    return slots;
+}
 
-        segments[tid] = buffer;
-        seg_lens[tid] = out_pos;
+// Put every distinct word (or symbol) of the packed lengths into the packed tables of its direction.
+// Symbols of 1-3 bytes are left to the short-symbol index.
+static void fill_packed_tables(unsigned char* image, const DictImageEntry* list, const char* pool,
+                               const uint32_t* keys, uint32_t n, bool by_symbol,
+                               const DictPackedIndex* index8, const DictPackedIndex* index16) {
+    DictPackedSlot* table8 = (DictPackedSlot*)(image + index8->offset);
+    DictPacked16Slot* table16 = (DictPacked16Slot*)(image + index16->offset);
+    for (uint32_t k = 0; k < n; k++) {
+        const DictImageEntry* e = &list[keys[k]];
+        uint32_t len, value_len;
+        const char* key = entry_key(e, pool, by_symbol, &len);
+        const char* value = entry_key(e, pool, !by_symbol, &value_len);
+        if (len > PACKED_KEY_MAX || (by_symbol && len <= 3)) continue;
+        uint32_t packed_value = value_len && value_len <= 3 ? pack_short_symbol(value, value_len) : 0;
+        PackedKey packed = pack_key(key, len);
+        if (len <= PACKED_WORD_MAX) {
+            uint32_t slot = packed_slot(packed.lo, index8->mask);
+            while (table8[slot].key) slot = (slot + 1) & index8->mask;
+            table8[slot] = (DictPackedSlot){ packed.lo, keys[k] + 1, packed_value };
+        } else {
+            uint32_t slot = packed16_slot(packed.lo, packed.hi, index16->mask);
+            while (table16[slot].key[0]) slot = (slot + 1) & index16->mask;
+            table16[slot] = (DictPacked16Slot){ { packed.lo, packed.hi }, keys[k] + 1, packed_value };
+        }
     }
+}
 
-    for (int i = 0; i < threads; i++) {
-        fwrite(segments[i], 1, seg_lens[i], out);
-        free(segments[i]);
+// Index the first `limit` symbols of 1-3 bytes among `keys`, carrying short words inline
+static void fill_short_table(DictShortSlot* table, uint32_t mask, const DictImageEntry* list, const char* pool,
+                             const uint32_t* keys, uint32_t n, uint32_t limit) {
+    for (uint32_t k = 0; k < n && limit; k++) {
+        const DictImageEntry* e = &list[keys[k]];
+        if (e->symbol_len > 3) continue;
+        uint32_t key = pack_short_symbol(pool + e->symbol_offset, e->symbol_len);
+        uint32_t slot = short_slot(key, mask);
+        while (table[slot].key) slot = (slot + 1) & mask;
+        uint32_t entry = keys[k] + 1;
+        uint64_t word = 0;
+        if (e->word_len <= SHORT_INLINE_MAX) {
+            entry |= e->word_len << 24;
+            word = pack_word(pool + e->word_offset, e->word_len);
+        }
+        table[slot] = (DictShortSlot){ key, entry, word };
+        limit--;
     }
+}
 
-    fclose(out);
-    free(segments);
-    free(seg_lens);
-    free(split_points);
-    free_dictionary(dict, dict_size);
-    free_hashmap(hashmap);
+// The hot word table: the first HOT_WORDS words of up to PACKED_WORD_MAX bytes among `keys`
+static void fill_hot_words(DictPackedSlot* table, uint32_t mask, const DictImageEntry* list, const char* pool,
+                           const uint32_t* keys, uint32_t n) {
+    uint32_t placed = 0;
+    for (uint32_t k = 0; k < n && placed < HOT_WORDS; k++) {
+        const DictImageEntry* e = &list[keys[k]];
+        if (e->word_len > PACKED_WORD_MAX) continue;
+        uint64_t key = pack_word(pool + e->word_offset, e->word_len);
+        uint32_t value = e->symbol_len && e->symbol_len <= 3 ? pack_short_symbol(pool + e->symbol_offset, e->symbol_len)
+                                                             : 0;
+        uint32_t slot = packed_slot(key, mask);
+        while (table[slot].key) slot = (slot + 1) & mask;
+        table[slot] = (DictPackedSlot){ key, keys[k] + 1, value };
+        placed++;
+    }
 }
 
-int main(int argc, char* argv[]) {
-    // Required arguments: mode, input, dict, lang, threads, output (6 total)
-    if (argc != 7) {
-        fprintf(stderr, "Usage: %s <-c|-d> <input_file> <dict_file> <lang_file> <threads> <output_file>\n", argv[0]);
-        fprintf(stderr, "  -c:  compress\n");
-        fprintf(stderr, "  -d:  decompress\n");
-        return 1;
+// Guards and Bloom filter over the distinct words, into space reserved as `prefilter` describes
+static void fill_prefilter(unsigned char* image, const DictImageEntry* list, const char* pool, const uint32_t* keys,
+                           uint32_t n, const DictPrefilter* prefilter) {
+    uint64_t* blocks = (uint64_t*)(image + prefilter->blocks_offset);
+    DictLengthGuard* guards = (DictLengthGuard*)(image + prefilter->guards_offset);
+    for (int len = 0; len <= PACKED_KEY_MAX; len++) guards[len] = (DictLengthGuard){ UINT64_MAX, 0 };
+    for (uint32_t k = 0; k < n; k++) {
+        uint32_t len;
+        const char* word = entry_key(&list[keys[k]], pool, false, &len);
+        PackedKey packed = { 0, 0 };
+        if (len <= PACKED_KEY_MAX) {
+            packed = pack_key(word, len);
+            if (packed.lo < guards[len].min) guards[len].min = packed.lo;
+            if (packed.lo > guards[len].max) guards[len].max = packed.lo;
+        }
+        uint64_t h = prefilter_hash(word, len, packed);
+        blocks[prefilter_block(h, prefilter->block_mask)] |= prefilter_bits(h);
     }
-    const char* mode_flag = argv[1];
-    const char* file_path = argv[2];
-    const char* dict_path = argv[3];
-    const char* language_path = argv[4];
-    int threads = atoi(argv[5]);
-    const char* output_path = argv[6];
+}
 
-    size_t input_len = 0;
-    char* input_buffer = read_file(file_path, "Input", &input_len);
+typedef struct {
+    DictTrieNode* nodes;
+    DictTrieAccept* accept;
+    uint32_t count;
+    uint32_t capacity;
+} TrieBuilder;
 
-    if (strcmp(mode_flag, "-c") == 0) {
-        compress(dict_path, language_path, input_buffer, input_len, threads, output_path);
-    } else if (strcmp(mode_flag, "-d") == 0) {
-        decompress(language_path, dict_path, input_buffer, input_len, threads, output_path);
-    } else {
-        fprintf(stderr, "Invalid mode\n");
-        free(input_buffer);
+typedef struct {
+    const char* word;
+    uint32_t len;
+    uint32_t entry;
+} TrieKey;
+
+static int compare_trie_keys(const void* a, const void* b) {
+    const TrieKey* x = a;
+    const TrieKey* y = b;
+    int c = memcmp(x->word, y->word, x->len < y->len ? x->len : y->len);
+    return c ? c : (x->len > y->len) - (x->len < y->len);
+}
+
+// Make nodes [0, n) exist, free unless already used
+static void trie_reserve(TrieBuilder* trie, uint64_t n) {
+    if (n <= trie->count) return;
+    if (n > UINT32_MAX - 1) {
+        fprintf(stderr, "Dictionary too large for an image\n");
+        exit(1);
+    }
+    if (n > trie->capacity) {
+        uint64_t capacity = trie->capacity ? trie->capacity : 1024;
+        while (capacity < n) capacity *= 2;
+        trie->nodes = realloc(trie->nodes, sizeof(DictTrieNode) * capacity);
+        trie->accept = realloc(trie->accept, sizeof(DictTrieAccept) * capacity);
+        if (!trie->nodes || !trie->accept) {
+            fprintf(stderr, "Memory allocation failed for dictionary\n");
+            exit(1);
+        }
+        trie->capacity = (uint32_t)capacity;
+    }
+    for (uint32_t t = trie->count; t < n; t++) {
+        trie->nodes[t] = (DictTrieNode){ 0, TRIE_FREE };
+        trie->accept[t] = (DictTrieAccept){ 0, 0 };
+    }
+    trie->count = (uint32_t)n;
+}
+
+// Build the double-array trie over the distinct words breadth first, giving each node the lowest
+// base where all its children land on free nodes
+static void build_trie(TrieBuilder* trie, const DictImageEntry* list, const char* pool, const uint32_t* keys,
+                       uint32_t n) {
+    typedef struct {
+        uint32_t node;
+        uint32_t lo;
+        uint32_t hi;
+        uint32_t depth;
+    } TrieTask;
+    TrieKey* sorted = malloc(sizeof(TrieKey) * (n ? n : 1));
+    uint64_t total_len = 0;
+    for (uint32_t k = 0; k < n; k++) {
+        uint32_t len;
+        const char* word = entry_key(&list[keys[k]], pool, false, &len);
+        sorted[k] = (TrieKey){ word, len, keys[k] };
+        total_len += len;
+    }
+    // Each node is queued once, and there is at most one per word byte besides the root
+    TrieTask* queue = malloc(sizeof(TrieTask) * (total_len + 1));
+    uint32_t* child_lo = malloc(sizeof(uint32_t) * 257);
+    if (!sorted || !queue || !child_lo) {
+        fprintf(stderr, "Memory allocation failed for dictionary\n");
+        exit(1);
+    }
+    qsort(sorted, n, sizeof(TrieKey), compare_trie_keys);
+
+    *trie = (TrieBuilder){ 0 };
+    trie_reserve(trie, 257);
+    trie->nodes[0].check = 0;
+    size_t head = 0, tail = 0;
+    queue[tail++] = (TrieTask){ 0, 0, n, 0 };
+    uint32_t first_free = 1;
+    while (head < tail) {
+        TrieTask task = queue[head++];
+        uint32_t lo = task.lo;
+        if (lo < task.hi && sorted[lo].len == task.depth) {
+            const DictImageEntry* e = &list[sorted[lo].entry];
+            uint32_t value = e->symbol_len && e->symbol_len <= 3
+                                 ? pack_short_symbol(pool + e->symbol_offset, e->symbol_len) : 0;
+            trie->accept[task.node] = (DictTrieAccept){ sorted[lo].entry + 1, value };
+            lo++;
+        }
+        if (lo == task.hi) continue;
+
+        // Children are the distinct next bytes; keys are sorted, so each one's keys are a run
+        uint32_t codes[256], child_count = 0;
+        for (uint32_t k = lo; k < task.hi; k++) {
+            uint32_t code = (unsigned char)sorted[k].word[task.depth] + 1;
+            if (child_count == 0 || codes[child_count - 1] != code) {
+                codes[child_count] = code;
+                child_lo[child_count++] = k;
+            }
+        }
+        child_lo[child_count] = task.hi;
+
+        // Scanning starts at first_free, which moves past any stretch that turns out to be nearly
+        // full (as darts does), so the long-lived holes left near the front aren't rescanned
+        while (first_free < trie->count && trie->nodes[first_free].check != TRIE_FREE) first_free++;
+        uint64_t pos = first_free > codes[0] ? first_free : codes[0];
+        uint64_t scanned = 0, occupied = 0;
+        uint32_t base;
+        for (;;) {
+            base = (uint32_t)(pos - codes[0]);
+            trie_reserve(trie, (uint64_t)base + 257);
+            bool fits = true;
+            for (uint32_t c = 0; c < child_count && fits; c++) fits = trie->nodes[base + codes[c]].check == TRIE_FREE;
+            if (fits) break;
+            do {
+                pos++;
+                scanned++;
+                occupied += pos < trie->count && trie->nodes[pos].check != TRIE_FREE;
+            } while (pos < trie->count && trie->nodes[pos].check != TRIE_FREE);
+        }
+        if (scanned >= 64 && occupied * 10 >= scanned * 9) first_free = (uint32_t)pos;
+        trie->nodes[task.node].base = base;
+        for (uint32_t c = 0; c < child_count; c++) {
+            trie->nodes[base + codes[c]].check = task.node;
+            queue[tail++] = (TrieTask){ base + codes[c], child_lo[c], child_lo[c + 1], task.depth + 1 };
+        }
+    }
+    free(sorted);
+    free(queue);
+    free(child_lo);
+}
+
+// Fill in the perfect hash for `keys` (distinct entry indexes): buckets are placed largest first,
+// each trying pilots until all its keys land on free positions. Returns the seed that worked;
+// a seed whose buckets can't all be placed is practically unheard of but just means another try.
+static uint64_t build_mphf(const DictImageEntry* entries, const char* pool, const uint32_t* keys, uint32_t n,
+                           bool by_symbol, uint32_t bucket_count, uint32_t position_count,
+                           uint32_t* pilots, uint32_t* slots, uint32_t* remap) {
+    if (n == 0) return 0;
+    uint32_t* placed_key = malloc(sizeof(uint32_t) * position_count);
+    uint64_t* hashes = malloc(sizeof(uint64_t) * n);
+    uint32_t* bucket_start = malloc(sizeof(uint32_t) * (bucket_count + 1));
+    uint32_t* members = malloc(sizeof(uint32_t) * n);
+    uint32_t* order = malloc(sizeof(uint32_t) * bucket_count);
+    uint32_t* size_start = malloc(sizeof(uint32_t) * (n + 2));
+    uint32_t* positions = malloc(sizeof(uint32_t) * n);
+    bool* taken = malloc(position_count);
+    if (!placed_key || !hashes || !bucket_start || !members || !order || !size_start || !positions || !taken) {
+        fprintf(stderr, "Memory allocation failed for dictionary\n");
+        exit(1);
+    }
+
+    for (uint64_t seed = 0;; seed++) {
+        memset(bucket_start, 0, sizeof(uint32_t) * (bucket_count + 1));
+        for (uint32_t k = 0; k < n; k++) {
+            uint32_t len;
+            const char* key = entry_key(&entries[keys[k]], pool, by_symbol, &len);
+            hashes[k] = dict_hash(key, len, seed);
+            bucket_start[mphf_bucket(hashes[k], bucket_count) + 1]++;
+        }
+        // Group keys by bucket, then order the buckets by size, largest first
+        for (uint32_t b = 0; b < bucket_count; b++) bucket_start[b + 1] += bucket_start[b];
+        for (uint32_t k = 0; k < n; k++) {
+            members[bucket_start[mphf_bucket(hashes[k], bucket_count)]++] = k;
+        }
+        for (uint32_t b = bucket_count; b > 0; b--) bucket_start[b] = bucket_start[b - 1];
+        bucket_start[0] = 0;
+        memset(size_start, 0, sizeof(uint32_t) * (n + 2));
+        for (uint32_t b = 0; b < bucket_count; b++) size_start[n - (bucket_start[b + 1] - bucket_start[b]) + 1]++;
+        for (uint32_t s = 0; s <= n; s++) size_start[s + 1] += size_start[s];
+        for (uint32_t b = 0; b < bucket_count; b++) {
+            order[size_start[n - (bucket_start[b + 1] - bucket_start[b])]++] = b;
+        }
+
+        memset(taken, 0, position_count);
+        bool placed = true;
+        for (uint32_t o = 0; o < bucket_count && placed; o++) {
+            uint32_t b = order[o];
+            uint32_t first = bucket_start[b], size = bucket_start[b + 1] - first;
+            pilots[b] = 0;
+            if (size == 0) continue;
+            placed = false;
+            for (uint32_t pilot = 0; pilot < (1u << 24) && !placed; pilot++) {
+                uint32_t k = 0;
+                for (; k < size; k++) {
+                    uint32_t p = mphf_position(hashes[members[first + k]], pilot, position_count);
+                    if (taken[p]) break;
+                    uint32_t q = 0;
+                    while (q < k && positions[q] != p) q++;
+                    if (q < k) break;
+                    positions[k] = p;
+                }
+                if (k < size) continue;
+                for (k = 0; k < size; k++) {
+                    taken[positions[k]] = true;
+                    placed_key[positions[k]] = keys[members[first + k]];
+                }
+                pilots[b] = pilot;
+                placed = true;
+            }
+        }
+        if (placed) {
+            // Exactly as many positions past n are taken as below n are free: pair them up in order
+            uint32_t free_pos = 0;
+            for (uint32_t p = 0; p < position_count; p++) {
+                if (p < n) {
+                    if (taken[p]) slots[p] = placed_key[p];
+                    continue;
+                }
+                remap[p - n] = 0;
+                if (!taken[p]) continue;
+                while (taken[free_pos]) free_pos++;
+                remap[p - n] = free_pos;
+                slots[free_pos++] = placed_key[p];
+            }
+            free(placed_key);
+            free(hashes);
+            free(bucket_start);
+            free(members);
+            free(order);
+            free(size_start);
+            free(positions);
+            free(taken);
+            return seed;
+        }
+    }
+}
+
+// Lay out the image for the given word/symbol pairs in one heap block. Only --trie reads the
+// trie, so with_trie false leaves its section empty rather than spend the time building it.
+static unsigned char* build_dictionary_image(const DictEntry* entries, size_t count, bool with_trie,
+                                             size_t* size_out) {
+    size_t words_size = 0, pool_size = 0;
+    for (size_t i = 0; i < count; i++) {
+        words_size += strlen(entries[i].word) + 1;
+        pool_size += strlen(entries[i].symbol) + 1;
+    }
+    pool_size += words_size;
+    if (pool_size > UINT32_MAX || count > SHORT_ENTRY_MASK) {
+        fprintf(stderr, "Dictionary too large for an image\n");
+        exit(1);
+    }
+
+    // The entry list and pool go first, into scratch space, since the tables are sized from them
+    DictImageEntry* list = malloc(sizeof(DictImageEntry) * (count ? count : 1));
+    char* pool = malloc(pool_size ? pool_size : 1);
+    if (!list || !pool) {
+        fprintf(stderr, "Memory allocation failed for dictionary\n");
+        exit(1);
+    }
+    size_t word_pos = 0, symbol_pos = words_size;
+    for (size_t i = 0; i < count; i++) {
+        size_t wlen = strlen(entries[i].word);
+        size_t slen = strlen(entries[i].symbol);
+        list[i] = (DictImageEntry){ (uint32_t)word_pos, (uint32_t)wlen, (uint32_t)symbol_pos, (uint32_t)slen };
+        memcpy(pool + word_pos, entries[i].word, wlen + 1);
+        memcpy(pool + symbol_pos, entries[i].symbol, slen + 1);
+        word_pos += wlen + 1;
+        symbol_pos += slen + 1;
+    }
+    uint32_t word_count, symbol_count;
+    uint32_t* word_keys = unique_keys(list, pool, (uint32_t)count, false, &word_count);
+    uint32_t* symbol_keys = unique_keys(list, pool, (uint32_t)count, true, &symbol_count);
+
+    uint32_t short_count = 0, words8 = 0, words16 = 0, symbols8 = 0, symbols16 = 0;
+    for (uint32_t k = 0; k < symbol_count; k++) {
+        uint32_t len = list[symbol_keys[k]].symbol_len;
+        short_count += len <= 3;
+        symbols8 += len > 3 && len <= PACKED_WORD_MAX;
+        symbols16 += len > PACKED_WORD_MAX && len <= PACKED_KEY_MAX;
+    }
+    for (uint32_t k = 0; k < word_count; k++) {
+        uint32_t len = list[word_keys[k]].word_len;
+        words8 += len <= PACKED_WORD_MAX;
+        words16 += len > PACKED_WORD_MAX && len <= PACKED_KEY_MAX;
+    }
+    uint32_t short_slots = packed_slot_count(short_count);
+    uint32_t max_word_len = 0;
+    for (uint32_t k = 0; k < word_count; k++) {
+        if (list[word_keys[k]].word_len > max_word_len) max_word_len = list[word_keys[k]].word_len;
+    }
+    TrieBuilder trie = { 0 };
+    if (with_trie) build_trie(&trie, list, pool, word_keys, word_count);
+    uint32_t prefilter_blocks = 1;
+    while ((uint64_t)prefilter_blocks * 64 < (uint64_t)word_count * PREFILTER_BITS_PER_KEY) {
+        prefilter_blocks <<= 1;
+    }
+
+    DictImageHeader header = {0};
+    memcpy(header.magic, DICT_IMAGE_MAGIC, 4);
+    header.version = DICT_IMAGE_VERSION;
+    header.byte_order = DICT_BYTE_ORDER;
+    header.entry_count = (uint32_t)count;
+    header.pool_size = (uint32_t)pool_size;
+    header.short_mask = short_slots - 1;
+    header.words8.mask = packed_slot_count(words8) - 1;
+    header.words16.mask = packed_slot_count(words16) - 1;
+    header.symbols8.mask = packed_slot_count(symbols8) - 1;
+    header.symbols16.mask = packed_slot_count(symbols16) - 1;
+    header.prefilter.block_mask = prefilter_blocks - 1;
+    header.hot_words.mask = packed_slot_count(words8 < HOT_WORDS ? words8 : HOT_WORDS) - 1;
+    header.hot_symbols.mask = packed_slot_count(short_count < HOT_WORDS ? short_count : HOT_WORDS) - 1;
+    header.prefilter.max_word_len = max_word_len;
+    header.words.key_count = word_count;
+    header.words.bucket_count = mphf_bucket_count(word_count);
+    header.words.position_count = mphf_position_count(word_count);
+    header.symbols.key_count = symbol_count;
+    header.symbols.bucket_count = mphf_bucket_count(symbol_count);
+    header.symbols.position_count = mphf_position_count(symbol_count);
+
+    uint64_t cursor = align8(sizeof(DictImageHeader));
+    header.entries_offset = reserve_section(&cursor, sizeof(DictImageEntry) * count);
+    header.words.pilots_offset = reserve_section(&cursor, sizeof(uint32_t) * header.words.bucket_count);
+    header.words.slots_offset = reserve_section(&cursor, sizeof(uint32_t) * word_count);
+    header.words.remap_offset = reserve_section(&cursor, sizeof(uint32_t) * (header.words.position_count - word_count));
+    header.symbols.pilots_offset = reserve_section(&cursor, sizeof(uint32_t) * header.symbols.bucket_count);
+    header.symbols.slots_offset = reserve_section(&cursor, sizeof(uint32_t) * symbol_count);
+    header.symbols.remap_offset =
+        reserve_section(&cursor, sizeof(uint32_t) * (header.symbols.position_count - symbol_count));
+    header.short_table_offset = reserve_section(&cursor, sizeof(DictShortSlot) * short_slots);
+    header.words8.offset = reserve_section(&cursor, sizeof(DictPackedSlot) * ((uint64_t)header.words8.mask + 1));
+    header.words16.offset = reserve_section(&cursor, sizeof(DictPacked16Slot) * ((uint64_t)header.words16.mask + 1));
+    header.symbols8.offset = reserve_section(&cursor, sizeof(DictPackedSlot) * ((uint64_t)header.symbols8.mask + 1));
+    header.symbols16.offset =
+        reserve_section(&cursor, sizeof(DictPacked16Slot) * ((uint64_t)header.symbols16.mask + 1));
+    header.prefilter.blocks_offset =
+        reserve_section(&cursor, sizeof(uint64_t) * (uint64_t)prefilter_blocks);
+    header.prefilter.guards_offset = reserve_section(&cursor, sizeof(DictLengthGuard) * (PACKED_KEY_MAX + 1));
+    header.hot_words.offset = reserve_section(&cursor, sizeof(DictPackedSlot) * ((uint64_t)header.hot_words.mask + 1));
+    header.hot_symbols.offset =
+        reserve_section(&cursor, sizeof(DictShortSlot) * ((uint64_t)header.hot_symbols.mask + 1));
+    header.trie.node_count = trie.count;
+    header.trie.nodes_offset = reserve_section(&cursor, sizeof(DictTrieNode) * (uint64_t)trie.count);
+    header.trie.accept_offset = reserve_section(&cursor, sizeof(DictTrieAccept) * (uint64_t)trie.count);
+    header.pool_offset = reserve_section(&cursor, pool_size);
+    header.image_size = cursor;
+
+    unsigned char* image = calloc(1, header.image_size);
+    if (!image) {
+        fprintf(stderr, "Memory allocation failed for dictionary\n");
+        exit(1);
+    }
+    memcpy(image + header.entries_offset, list, sizeof(DictImageEntry) * count);
+    memcpy(image + header.pool_offset, pool, pool_size);
+
+    header.words.seed = build_mphf(list, pool, word_keys, word_count, false, header.words.bucket_count,
+                                   header.words.position_count, (uint32_t*)(image + header.words.pilots_offset),
+                                   (uint32_t*)(image + header.words.slots_offset),
+                                   (uint32_t*)(image + header.words.remap_offset));
+    header.symbols.seed = build_mphf(list, pool, symbol_keys, symbol_count, true, header.symbols.bucket_count,
+                                     header.symbols.position_count, (uint32_t*)(image + header.symbols.pilots_offset),
+                                     (uint32_t*)(image + header.symbols.slots_offset),
+                                     (uint32_t*)(image + header.symbols.remap_offset));
+
+    fill_short_table((DictShortSlot*)(image + header.short_table_offset), header.short_mask, list, pool,
+                     symbol_keys, symbol_count, UINT32_MAX);
+    fill_short_table((DictShortSlot*)(image + header.hot_symbols.offset), header.hot_symbols.mask, list, pool,
+                     symbol_keys, symbol_count, HOT_WORDS);
+    fill_hot_words((DictPackedSlot*)(image + header.hot_words.offset), header.hot_words.mask, list, pool,
+                   word_keys, word_count);
+    fill_packed_tables(image, list, pool, word_keys, word_count, false, &header.words8, &header.words16);
+    fill_packed_tables(image, list, pool, symbol_keys, symbol_count, true, &header.symbols8, &header.symbols16);
+    fill_prefilter(image, list, pool, word_keys, word_count, &header.prefilter);
+    if (trie.count) {
+        memcpy(image + header.trie.nodes_offset, trie.nodes, sizeof(DictTrieNode) * (size_t)trie.count);
+        memcpy(image + header.trie.accept_offset, trie.accept, sizeof(DictTrieAccept) * (size_t)trie.count);
+    }
+    free(trie.nodes);
+    free(trie.accept);
+    memcpy(image, &header, sizeof(header));
+
+    free(word_keys);
+    free(symbol_keys);
+    free(list);
+    free(pool);
+    *size_out = header.image_size;
+    return image;
+}
+
+static void corrupt_dictionary(const char* path) {
+    fprintf(stderr, "Corrupt or incompatible dictionary image: %s (this build reads version %d)\n",
+            path, DICT_IMAGE_VERSION);
+    exit(1);
+}
+
+// Whether an 8-aligned section of `bytes` at `offset` lies within the image after its header
+static bool section_fits(const DictImageHeader* header, uint64_t offset, uint64_t bytes) {
+    return offset % 8 == 0 && offset >= sizeof(DictImageHeader) && offset <= header->image_size &&
+           bytes <= header->image_size - offset;
+}
+
+static bool attach_mphf(MphfTable* table, const DictMphf* mphf, const Dictionary* dict, const DictImageHeader* header) {
+    if (mphf->key_count > header->entry_count || (mphf->key_count && !mphf->bucket_count) ||
+        mphf->position_count < mphf->key_count ||
+        !section_fits(header, mphf->pilots_offset, sizeof(uint32_t) * (uint64_t)mphf->bucket_count) ||
+        !section_fits(header, mphf->slots_offset, sizeof(uint32_t) * (uint64_t)mphf->key_count) ||
+        !section_fits(header, mphf->remap_offset,
+                      sizeof(uint32_t) * (uint64_t)(mphf->position_count - mphf->key_count))) return false;
+    table->pilots = (const uint32_t*)(dict->image + mphf->pilots_offset);
+    table->slots = (const uint32_t*)(dict->image + mphf->slots_offset);
+    table->remap = (const uint32_t*)(dict->image + mphf->remap_offset);
+    table->seed = mphf->seed;
+    table->key_count = mphf->key_count;
+    table->bucket_count = mphf->bucket_count;
+    table->position_count = mphf->position_count;
+    for (uint32_t s = 0; s < mphf->key_count; s++) {
+        if (table->slots[s] >= header->entry_count) return false;
+    }
+    for (uint32_t r = 0; mphf->key_count && r < mphf->position_count - mphf->key_count; r++) {
+        if (table->remap[r] >= mphf->key_count) return false;
+    }
+    return true;
+}
+
+static bool attach_short_table(ShortTable* table, uint64_t offset, uint32_t mask, const Dictionary* dict,
+                               const DictImageHeader* header) {
+    uint64_t slots = (uint64_t)mask + 1;
+    if ((slots & mask) != 0 || !section_fits(header, offset, sizeof(DictShortSlot) * slots)) return false;
+    table->slots = (const DictShortSlot*)(dict->image + offset);
+    table->mask = mask;
+    uint64_t empty = 0;
+    for (uint64_t s = 0; s < slots; s++) {
+        const DictShortSlot* slot = &table->slots[s];
+        uint32_t entry = slot->entry & SHORT_ENTRY_MASK, inline_len = slot->entry >> 24;
+        if (entry > header->entry_count || (slot->key && !entry) || inline_len > SHORT_INLINE_MAX ||
+            (inline_len && (!entry || inline_len != dict->entries[entry - 1].word_len))) return false;
+        empty += slot->key == 0;
+    }
+    return empty > 0;
+}
+
+// Every base must leave room for any byte's transition, and every check name a node. An image
+// built without a trie has none and leaves dict->trie NULL.
+static bool attach_trie(Dictionary* dict, const DictImageHeader* header) {
+    uint64_t count = header->trie.node_count;
+    if (count == 0) return true;
+    if (count < 257 || !section_fits(header, header->trie.nodes_offset, sizeof(DictTrieNode) * count) ||
+        !section_fits(header, header->trie.accept_offset, sizeof(DictTrieAccept) * count)) return false;
+    dict->trie = (const DictTrieNode*)(dict->image + header->trie.nodes_offset);
+    dict->trie_accept = (const DictTrieAccept*)(dict->image + header->trie.accept_offset);
+    dict->trie_nodes = header->trie.node_count;
+    for (uint64_t t = 0; t < count; t++) {
+        if ((uint64_t)dict->trie[t].base + 256 >= count ||
+            (dict->trie[t].check != TRIE_FREE && dict->trie[t].check >= count) ||
+            dict->trie_accept[t].entry > header->entry_count) return false;
+    }
+    return true;
+}
+
+static bool attach_packed8(Packed8Table* table, const DictPackedIndex* index, const Dictionary* dict,
+                           const DictImageHeader* header) {
+    uint64_t slots = (uint64_t)index->mask + 1;
+    if ((slots & index->mask) != 0 || !section_fits(header, index->offset, sizeof(DictPackedSlot) * slots)) {
+        return false;
+    }
+    table->slots = (const DictPackedSlot*)(dict->image + index->offset);
+    table->mask = index->mask;
+    uint64_t empty = 0;
+    for (uint64_t s = 0; s < slots; s++) {
+        const DictPackedSlot* slot = &table->slots[s];
+        if (slot->entry > header->entry_count || (slot->key && !slot->entry)) return false;
+        empty += slot->key == 0;
+    }
+    return empty > 0;
+}
+
+static bool attach_packed16(Packed16Table* table, const DictPackedIndex* index, const Dictionary* dict,
+                            const DictImageHeader* header) {
+    uint64_t slots = (uint64_t)index->mask + 1;
+    if ((slots & index->mask) != 0 || !section_fits(header, index->offset, sizeof(DictPacked16Slot) * slots)) {
+        return false;
+    }
+    table->slots = (const DictPacked16Slot*)(dict->image + index->offset);
+    table->mask = index->mask;
+    uint64_t empty = 0;
+    for (uint64_t s = 0; s < slots; s++) {
+        const DictPacked16Slot* slot = &table->slots[s];
+        if (slot->entry > header->entry_count || (slot->key[0] && !slot->entry)) return false;
+        empty += slot->key[0] == 0;
+    }
+    return empty > 0;
+}
+
+// Size of the last-level cache, or LOOKUP_BATCH_MIN_BYTES when the system doesn't say
+static uint64_t last_level_cache_size(void) {
+#if defined(CX_HAVE_MMAP) && defined(_SC_LEVEL3_CACHE_SIZE)
+    long l3 = sysconf(_SC_LEVEL3_CACHE_SIZE);
+    if (l3 > 0) return (uint64_t)l3;
+    long l2 = sysconf(_SC_LEVEL2_CACHE_SIZE);
+    if (l2 > 0) return (uint64_t)l2;
+#endif
+    return LOOKUP_BATCH_MIN_BYTES;
+}
+
+// CX_BATCH=1 batches lookups whatever the size of the tables and CX_BATCH=0 never does, which is
+// how the batched path is checked and measured on hosts whose cache holds any dictionary.
+// Unset or "auto" leaves it to last_level_cache_size(); returns -1 then.
+static int lookup_batch_override(void) {
+    const char* mode = getenv("CX_BATCH");
+    if (!mode || !*mode || strcmp(mode, "auto") == 0) return -1;
+    if (strcmp(mode, "0") == 0 || strcmp(mode, "1") == 0) return mode[0] - '0';
+    static bool warned = false;
+    if (!warned) fprintf(stderr, "Ignoring CX_BATCH=%s (expected 0, 1 or auto)\n", mode);
+    warned = true;
+    return -1;
+}
+
+// Point `dict` at the sections of a loaded image, checking that everything lies inside it;
+// false when the image is damaged or from another version
+static bool attach_dictionary_image(Dictionary* dict) {
+    DictImageHeader header;
+    if (dict->image_size < sizeof(header)) return false;
+    memcpy(&header, dict->image, sizeof(header));
+    if (memcmp(header.magic, DICT_IMAGE_MAGIC, 4) != 0 || header.byte_order != DICT_BYTE_ORDER ||
+        header.version != DICT_IMAGE_VERSION) return false;
+    uint64_t prefilter_blocks = (uint64_t)header.prefilter.block_mask + 1;
+    if (header.image_size != dict->image_size ||
+        (prefilter_blocks & header.prefilter.block_mask) != 0 ||
+        !section_fits(&header, header.prefilter.blocks_offset, sizeof(uint64_t) * prefilter_blocks) ||
+        !section_fits(&header, header.prefilter.guards_offset, sizeof(DictLengthGuard) * (PACKED_KEY_MAX + 1)) ||
+        !section_fits(&header, header.entries_offset, sizeof(DictImageEntry) * (uint64_t)header.entry_count) ||
+        !section_fits(&header, header.pool_offset, header.pool_size)) {
+        return false;
+    }
+
+    dict->entries = (const DictImageEntry*)(dict->image + header.entries_offset);
+    dict->pool = (const char*)(dict->image + header.pool_offset);
+    dict->pool_size = header.pool_size;
+    dict->prefilter = (const uint64_t*)(dict->image + header.prefilter.blocks_offset);
+    dict->guards = (const DictLengthGuard*)(dict->image + header.prefilter.guards_offset);
+    dict->prefilter_mask = header.prefilter.block_mask;
+    dict->max_word_len = header.prefilter.max_word_len;
+    dict->entry_count = header.entry_count;
+
+    // A stray offset would send lookups outside the image, so check each entry and slot once
+    for (uint32_t i = 0; i < header.entry_count; i++) {
+        const DictImageEntry* e = &dict->entries[i];
+        if ((uint64_t)e->word_offset + e->word_len >= header.pool_size ||
+            (uint64_t)e->symbol_offset + e->symbol_len >= header.pool_size) return false;
+    }
+    if (!attach_mphf(&dict->words, &header.words, dict, &header) ||
+        !attach_mphf(&dict->symbols, &header.symbols, dict, &header)) return false;
+    // ...and that each probed table has an empty slot to end a probe
+    if (!attach_short_table(&dict->short_symbols, header.short_table_offset, header.short_mask, dict, &header) ||
+        !attach_short_table(&dict->hot_symbols, header.hot_symbols.offset, header.hot_symbols.mask, dict, &header) ||
+        !attach_packed8(&dict->hot_words, &header.hot_words, dict, &header) ||
+        !attach_trie(dict, &header) ||
+        !attach_packed8(&dict->words8, &header.words8, dict, &header) ||
+        !attach_packed16(&dict->words16, &header.words16, dict, &header) ||
+        !attach_packed8(&dict->symbols8, &header.symbols8, dict, &header) ||
+        !attach_packed16(&dict->symbols16, &header.symbols16, dict, &header)) return false;
+
+    uint64_t word_bytes = ((uint64_t)dict->words8.mask + 1) * sizeof(DictPackedSlot) +
+                          ((uint64_t)dict->words16.mask + 1) * sizeof(DictPacked16Slot) +
+                          sizeof(uint64_t) * prefilter_blocks;
+    uint64_t symbol_bytes = ((uint64_t)dict->short_symbols.mask + 1) * sizeof(DictShortSlot) +
+                            ((uint64_t)dict->symbols8.mask + 1) * sizeof(DictPackedSlot) +
+                            ((uint64_t)dict->symbols16.mask + 1) * sizeof(DictPacked16Slot);
+    int forced = lookup_batch_override();
+    uint64_t cache_bytes = last_level_cache_size();
+    dict->batch_words = forced < 0 ? word_bytes > cache_bytes : forced;
+    dict->batch_symbols = forced < 0 ? symbol_bytes > cache_bytes : forced;
+    return true;
+}
+
+// Map a prebuilt image read-only; the pages are shared with every other process using it
+static void map_dictionary_image(Dictionary* dict, FILE* file) {
+#ifdef CX_HAVE_MMAP
+    struct stat st;
+    if (fstat(fileno(file), &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void* map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fileno(file), 0);
+        if (map != MAP_FAILED) {
+            dict->image = map;
+            dict->image_size = (size_t)st.st_size;
+            dict->mapped = true;
+            return;
+        }
+    }
+#endif
+    rewind(file);
+    dict->image = (unsigned char*)read_stream(file, &dict->image_size);
+}
+
+// Read the word and language-pack files pairwise, one entry per pair of non-empty lines
+static DictEntry* read_dictionary_text(const char* dict_path, const char* lang_path, size_t* count) {
+    FILE* dict_file = fopen(dict_path, "r");
+    FILE* lang_file = fopen(lang_path, "r");
+
+    if (!dict_file || !lang_file) {
+        fprintf(stderr, "Failed to open dictionary (%s) or language file (%s)\n", dict_path, lang_path);
+        exit(1);
+    }
+
+    DictEntry* entries = malloc(sizeof(DictEntry) * MAX_ENTRIES);
+    if (!entries) {
+        fprintf(stderr, "Memory allocation failed for dictionary\n");
+        exit(1);
+    }
+
+    char dict_line[MAX_LINE];
+    char lang_line[MAX_LINE];
+    size_t i = 0;
+
+    while (i < MAX_ENTRIES && fgets(dict_line, MAX_LINE, dict_file) && fgets(lang_line, MAX_LINE, lang_file)) {
+        dict_line[strcspn(dict_line, "\n")] = 0;
+        lang_line[strcspn(lang_line, "\n")] = 0;
+        if (strlen(dict_line) == 0 || strlen(lang_line) == 0) {
+            continue;
+        }
+
+        entries[i].word = strdup(dict_line);
+        entries[i].symbol = strdup(lang_line);
+        i++;
+    }
+
+    fclose(dict_file);
+    fclose(lang_file);
+
+    *count = i;
+    return entries;
+}
+
+static void free_dictionary_text(DictEntry* entries, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        free(entries[i].word);
+        free(entries[i].symbol);
+    }
+    free(entries);
+}
+
+void free_dictionary(Dictionary* dict) {
+    if (dict->embedded) {
+        dict->image = NULL;
+        return;
+    }
+#ifdef CX_HAVE_MMAP
+    if (dict->mapped) {
+        munmap(dict->image, dict->image_size);
+        dict->image = NULL;
+        return;
+    }
+#endif
+    free(dict->image);
+    dict->image = NULL;
+}
+
+// --shm: a text dictionary compiled by one process is published as an image file in shared
+// memory, named after the identity of its source files, and later processes of the same user
+// map that read-only instead of compiling their own copy. Editing either file changes the name.
+bool share_dictionaries = false;
+
+// --trie: compress with the dictionary's trie instead of the hash tables
+bool use_trie = false;
+
+#ifdef CX_HAVE_MMAP
+#ifdef __linux__
+#define SHARED_DICT_DIR "/dev/shm"
+#else
+#define SHARED_DICT_DIR "/tmp"
+#endif
+
+// The names are predictable, so images live in a directory per user and are only trusted when
+// they and that directory belong to this user and nobody else can write to them. Otherwise
+// another local user could plant an image with a mapping of their own.
+static bool owned_privately(const struct stat* st) {
+    return st->st_uid == geteuid() && (st->st_mode & (S_IWGRP | S_IWOTH)) == 0;
+}
+
+static bool shared_dictionary_dir(char* dir, size_t size) {
+    const char* base = getenv("CX_SHM_DIR");
+    if (!base) base = SHARED_DICT_DIR;
+    if (snprintf(dir, size, "%s/cxcompress-%lu", base, (unsigned long)geteuid()) >= (int)size) return false;
+    if (mkdir(dir, 0700) != 0 && errno != EEXIST) return false;
+    // lstat, so a symlink planted under the name is refused rather than followed
+    struct stat st;
+    return lstat(dir, &st) == 0 && S_ISDIR(st.st_mode) && owned_privately(&st);
+}
+
+static bool shared_dictionary_path(const char* dict_path, const char* lang_path, char* path, size_t size) {
+    struct stat st[2];
+    if (stat(dict_path, &st[0]) != 0 || stat(lang_path, &st[1]) != 0) return false;
+    uint64_t key[9] = { DICT_IMAGE_VERSION };
+    for (int f = 0; f < 2; f++) {
+        key[1 + f * 4] = (uint64_t)st[f].st_dev;
+        key[2 + f * 4] = (uint64_t)st[f].st_ino;
+        key[3 + f * 4] = (uint64_t)st[f].st_size;
+        key[4 + f * 4] = (uint64_t)st[f].st_mtime;
+    }
+    uint64_t h = dict_hash((const char*)key, sizeof(key), 0);
+    char dir[4096];
+    if (!shared_dictionary_dir(dir, sizeof(dir))) return false;
+    return snprintf(path, size, "%s/%016llx.cxd", dir, (unsigned long long)h) < (int)size;
+}
+
+static bool attach_shared_dictionary(Dictionary* dict, const char* path) {
+    int fd = open(path, O_RDONLY | O_NOFOLLOW);
+    if (fd < 0) return false;
+    struct stat st;
+    FILE* file = NULL;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || !owned_privately(&st) || !(file = fdopen(fd, "rb"))) {
+        close(fd);
+        return false;
+    }
+    map_dictionary_image(dict, file);
+    fclose(file);
+    if (dict->mapped && attach_dictionary_image(dict)) return true;
+    free_dictionary(dict);
+    memset(dict, 0, sizeof(*dict));
+    return false;
+}
+
+// Write the image to a fresh file beside its final name and rename it into place, so readers
+// only ever see it whole; a racing publisher just replaces it with an identical copy. Any
+// failure leaves this process on its private image.
+static void publish_shared_dictionary(Dictionary* dict, const char* path) {
+    char temp[4096 + 32];
+    snprintf(temp, sizeof(temp), "%s.XXXXXX", path);
+    int fd = mkstemp(temp);
+    if (fd < 0) return;
+    FILE* out = fdopen(fd, "wb");
+    if (!out) {
+        close(fd);
+        remove(temp);
+        return;
+    }
+    bool ok = fwrite(dict->image, 1, dict->image_size, out) == dict->image_size;
+    ok = fclose(out) == 0 && ok;
+    if (!ok || rename(temp, path) != 0) {
+        remove(temp);
+        return;
+    }
+    Dictionary shared;
+    memset(&shared, 0, sizeof(shared));
+    if (attach_shared_dictionary(&shared, path)) {
+        free_dictionary(dict);
+        *dict = shared;
+    }
+}
+#else
+static bool shared_dictionary_path(const char* dict_path, const char* lang_path, char* path, size_t size) {
+    (void)dict_path; (void)lang_path; (void)path; (void)size;
+    return false;
+}
+
+static bool attach_shared_dictionary(Dictionary* dict, const char* path) {
+    (void)dict; (void)path;
+    return false;
+}
+
+static void publish_shared_dictionary(Dictionary* dict, const char* path) {
+    (void)dict; (void)path;
+}
+#endif
+
+// Dictionary name that selects the image compiled in with CX_EMBEDDED_DICT
+#define EMBEDDED_DICT_NAME "default"
+
+// Load the dictionary, which serves both directions. dict_path may name a prebuilt image,
+// or EMBEDDED_DICT_NAME, in which case lang_path is ignored.
+Dictionary load_dictionary(const char* dict_path, const char* lang_path) {
+    Dictionary dict;
+    memset(&dict, 0, sizeof(dict));
+
+    if (strcmp(dict_path, EMBEDDED_DICT_NAME) == 0) {
+#ifdef CX_EMBEDDED_DICT
+        dict.image = (unsigned char*)cx_default_dict;
+        dict.image_size = cx_default_dict_size;
+        dict.embedded = true;
+#else
+        fprintf(stderr, "This build has no embedded dictionary; compile with -DCX_EMBEDDED_DICT\n");
+        exit(1);
+#endif
+    } else {
+        FILE* file = fopen(dict_path, "rb");
+        if (!file) {
+            fprintf(stderr, "Failed to open dictionary (%s) or language file (%s)\n", dict_path, lang_path);
+            exit(1);
+        }
+        char magic[4];
+        bool is_image = fread(magic, 1, 4, file) == 4 && memcmp(magic, DICT_IMAGE_MAGIC, 4) == 0;
+        if (is_image) {
+            map_dictionary_image(&dict, file);
+        } else {
+            char shared_path[4096];
+            bool shared = share_dictionaries &&
+                          shared_dictionary_path(dict_path, lang_path, shared_path, sizeof(shared_path));
+            if (!shared || !attach_shared_dictionary(&dict, shared_path)) {
+                size_t count = 0;
+                DictEntry* entries = read_dictionary_text(dict_path, lang_path, &count);
+                // A published image serves later --trie runs too
+                dict.image = build_dictionary_image(entries, count, use_trie || shared, &dict.image_size);
+                free_dictionary_text(entries, count);
+                if (shared) publish_shared_dictionary(&dict, shared_path);
+            }
+        }
+        fclose(file);
+    }
+    if (!attach_dictionary_image(&dict)) corrupt_dictionary(dict_path);
+    if (use_trie && !dict.trie) {
+        fprintf(stderr, "Dictionary image %s has no trie for --trie; rebuild it with --build-dict\n", dict_path);
+        exit(1);
+    }
+    return dict;
+}
+
+
+// --build-dict: compile the text dictionary and language pack into an image at image_path.
+// With as_header the image is written as the C header that -DCX_EMBEDDED_DICT compiles in.
+void build_dictionary_file(const char* dict_path, const char* lang_path, const char* image_path, bool as_header) {
+    size_t count = 0;
+    DictEntry* entries = read_dictionary_text(dict_path, lang_path, &count);
+    size_t size = 0;
+    unsigned char* image = build_dictionary_image(entries, count, true, &size);
+    free_dictionary_text(entries, count);
+
+    FILE* out = open_output(image_path, "dictionary image");
+    if (as_header) {
+        fprintf(out, "// Generated by CXcompress --build-dict-header from %s and %s; do not edit\n", dict_path, lang_path);
+        fprintf(out, "static const size_t cx_default_dict_size = %zu;\n", size);
+        // The image is used in place, so it needs the alignment its tables were laid out for
+        fprintf(out, "static _Alignas(8) const unsigned char cx_default_dict[%zu] = {\n", size);
+        for (size_t i = 0; i < size; i++) {
+            fprintf(out, "%d,%s", image[i], (i % 32 == 31 || i + 1 == size) ? "\n" : "");
+        }
+        fprintf(out, "};\n");
+    } else {
+        fwrite(image, 1, size, out);
+    }
+    close_output(out);
+    free(image);
+}
+
+// Worst-case growth of a span through each transform, used to size output buffers
+#define COMPRESS_EXPANSION 2
+
+#define DEFAULT_WINDOW (1 << 20)
+#define MIN_WINDOW (64 << 10)
+
+// Counters for --stats, summed over every span the run transforms
+typedef struct {
+    uint64_t words;
+    uint64_t hits;
+    uint64_t hot_hits;
+    uint64_t prefilter_rejects;
+    uint64_t prefilter_false_positives;
+    // Seconds spent in each stage of the hash kernels, summed over threads; timed only for --stats
+    double tokenize_seconds;
+    double prefetch_seconds;
+    double resolve_seconds;
+    // Token blocks that went through the prefetch stage; none unless lookups are batched
+    uint64_t prefetched_blocks;
+} TransformStats;
+
+bool print_stats = false;
+static TransformStats transform_stats;
+
+// Fold a span's counters into the run's
+static void add_transform_stats(const TransformStats* st) {
+    #pragma omp atomic
+    transform_stats.words += st->words;
+    #pragma omp atomic
+    transform_stats.hits += st->hits;
+    #pragma omp atomic
+    transform_stats.hot_hits += st->hot_hits;
+    #pragma omp atomic
+    transform_stats.prefilter_rejects += st->prefilter_rejects;
+    #pragma omp atomic
+    transform_stats.prefilter_false_positives += st->prefilter_false_positives;
+    #pragma omp atomic
+    transform_stats.tokenize_seconds += st->tokenize_seconds;
+    #pragma omp atomic
+    transform_stats.prefetch_seconds += st->prefetch_seconds;
+    #pragma omp atomic
+    transform_stats.resolve_seconds += st->resolve_seconds;
+    #pragma omp atomic
+    transform_stats.prefetched_blocks += st->prefetched_blocks;
+}
+
+static void print_transform_stats(void) {
+    const TransformStats* st = &transform_stats;
+    uint64_t misses = st->words - st->hits;
+    fprintf(stderr, "Tokens looked up: %llu (%llu in the dictionary, %llu of them in the hot tier)\n",
+            (unsigned long long)st->words, (unsigned long long)st->hits, (unsigned long long)st->hot_hits);
+    if (st->tokenize_seconds + st->resolve_seconds > 0) {
+        char prefetch[32] = "off";
+        if (st->prefetched_blocks) snprintf(prefetch, sizeof(prefetch), "%.3fs", st->prefetch_seconds);
+        fprintf(stderr, "Stage time:       tokenize %.3fs, prefetch %s, resolve %.3fs (%s delimiter scan)\n",
+                st->tokenize_seconds, prefetch, st->resolve_seconds, delimiter_scan.isa);
+    }
+    // Only compression consults the prefilter
+    if (st->prefilter_rejects + st->prefilter_false_positives == 0) return;
+    fprintf(stderr, "Prefilter:        %llu rejected, %llu false positives (%.2f%% of misses)\n",
+            (unsigned long long)st->prefilter_rejects, (unsigned long long)st->prefilter_false_positives,
+            misses ? 100.0 * (double)st->prefilter_false_positives / (double)misses : 0.0);
+}
+
+// Copy the delimiters data[*pos, stop) to buffer, where data ends at end_pos; false when they
+// don't all fit, with *pos at the first one that didn't
+static inline bool copy_delimiters(const char* data, size_t end_pos, size_t* pos, size_t stop, char* buffer,
+                                   size_t out_cap, size_t* out_pos) {
+    // The positions are kept in locals, since stores through char* could otherwise alias them
+    size_t in = *pos, out = *out_pos;
+    if (stop - in <= out_cap - out) {
+        copy_short(&buffer[out], out_cap - out, &data[in], end_pos - in, stop - in);
+        *out_pos = out + (stop - in);
+        *pos = stop;
+        return true;
+    }
+    while (in < stop && out < out_cap) buffer[out++] = data[in++];
+    *pos = in;
+    *out_pos = out;
+    return false;
+}
+
+// compress_span() for --trie: each word is matched while it is scanned, touching every byte once.
+// A byte with no transition ends the match and the rest of the word is only scanned for its end.
+static size_t compress_span_trie(const char* input_buffer, size_t start_pos, size_t end_pos,
+                                 char escape_char, const Dictionary* dict, char* buffer, size_t out_cap,
+                                 size_t* next_pos) {
+    const DictTrieNode* trie = dict->trie;
+    size_t out_pos = 0;
+    size_t i = start_pos;
+    TransformStats stats = { 0 };
+
+    while (i < end_pos) {
+        if (is_delimiter(input_buffer[i])) {
+            if (out_pos == out_cap) break;
+            buffer[out_pos++] = input_buffer[i];
+            i++;
+            continue;
+        }
+
+        size_t word_start = i;
+        uint32_t node = 0;
+        bool matched = true;
+        while (i < end_pos && !is_delimiter(input_buffer[i])) {
+            uint32_t next = trie[node].base + (unsigned char)input_buffer[i] + 1;
+            i++;
+            if (trie[next].check != node) {
+                matched = false;
+                while (i < end_pos && !is_delimiter(input_buffer[i])) i++;
+                break;
+            }
+            node = next;
+        }
+        size_t word_len = i - word_start;
+        const char* word_ptr = &input_buffer[word_start];
+        const DictTrieAccept* accept = matched && dict->trie_accept[node].entry ? &dict->trie_accept[node] : NULL;
+
+        if (accept && accept->value) {
+            if ((accept->value >> 24) > out_cap - out_pos) { i = word_start; break; }
+            out_pos += emit_packed_value(&buffer[out_pos], out_cap - out_pos, accept->value);
+        } else if (accept) {
+            const DictImageEntry* e = &dict->entries[accept->entry - 1];
+            if (e->symbol_len > out_cap - out_pos) { i = word_start; break; }
+            copy_short(&buffer[out_pos], out_cap - out_pos, dict->pool + e->symbol_offset,
+                       dict->pool_size - e->symbol_offset, e->symbol_len);
+            out_pos += e->symbol_len;
+        } else {
+            if (word_len + 1 > out_cap - out_pos) { i = word_start; break; }
+            if (is_symbol_fast(dict, word_ptr, word_len)) {
+                buffer[out_pos++] = escape_char;
+            }
+            copy_short(&buffer[out_pos], out_cap - out_pos, word_ptr, end_pos - word_start, word_len);
+            out_pos += word_len;
+        }
+        stats.words++;
+        stats.hits += accept != NULL;
+    }
+    add_transform_stats(&stats);
+    *next_pos = i;
+    return out_pos;
+}
+
+// Stage clock for --stats: the time since *mark, which moves to now; 0 when not timing
+static inline double stage_seconds(double* mark) {
+    if (!print_stats) return 0;
+    double now = omp_get_wtime();
+    double elapsed = now - *mark;
+    *mark = now;
+    return elapsed;
+}
+
+// Resolve one word, with `readable` bytes of input from word_ptr on, and write its symbol, or
+// the literal (escaped when it would read back as a symbol), at buffer[*out_pos]; false,
+// writing nothing, when that doesn't fit
+static inline bool compress_word(const Dictionary* dict, const char* word_ptr, size_t word_len, size_t readable,
+                                 PackedKey key, char escape_char, char* buffer, size_t out_cap, size_t* out_pos,
+                                 TransformStats* stats) {
+    // Most words outside the dictionary stop at the prefilter, and the most frequent ones
+    // resolve in the hot table. The rest resolve with one integer-keyed probe into the packed
+    // table for their length, which holds every dictionary word that short, so a miss there is
+    // final; only longer words go through the hash.
+    uint32_t entry = 0, value = 0;
+    bool rejected = !prefilter_may_contain(dict, word_ptr, word_len, key);
+    const DictPackedSlot* hot = NULL;
+    if (!rejected && word_len <= PACKED_WORD_MAX) hot = packed8_find(&dict->hot_words, key);
+    if (hot) {
+        entry = hot->entry;
+        value = hot->value;
+    } else if (!rejected) {
+        if (word_len <= PACKED_WORD_MAX) {
+            const DictPackedSlot* hit = packed8_find(&dict->words8, key);
+            if (hit) { entry = hit->entry; value = hit->value; }
+        } else if (word_len <= PACKED_KEY_MAX) {
+            const DictPacked16Slot* hit = packed16_find(&dict->words16, key);
+            if (hit) { entry = hit->entry; value = hit->value; }
+        } else {
+            const DictImageEntry* found = dict_find(dict, false, word_ptr, word_len);
+            if (found) entry = (uint32_t)(found - dict->entries) + 1;
+        }
+    }
+
+    size_t out = *out_pos;
+    if (value) {
+        if ((value >> 24) > out_cap - out) return false;
+        out += emit_packed_value(&buffer[out], out_cap - out, value);
+    } else if (entry) {
+        const DictImageEntry* e = &dict->entries[entry - 1];
+        if (e->symbol_len > out_cap - out) return false;
+        copy_short(&buffer[out], out_cap - out, dict->pool + e->symbol_offset, dict->pool_size - e->symbol_offset,
+                   e->symbol_len);
+        out += e->symbol_len;
+    } else {
+        if (word_len + 1 > out_cap - out) return false;
+        if (is_symbol_fast(dict, word_ptr, word_len)) {
+            buffer[out++] = escape_char;
+        }
+        copy_short(&buffer[out], out_cap - out, word_ptr, readable, word_len);
+        out += word_len;
+    }
+    *out_pos = out;
+    stats->words++;
+    stats->hits += entry != 0;
+    stats->hot_hits += hot != NULL;
+    stats->prefilter_rejects += rejected;
+    stats->prefilter_false_positives += !rejected && !entry;
+    return true;
+}
+
+// Pack the keys of the words in spans[0, n) and prefetch the slots they will probe
+static void prefetch_words(const Dictionary* dict, const char* data, size_t end_pos, const TokenSpan* spans,
+                           size_t n, PackedKey* keys) {
+    for (size_t b = 0; b < n; b++) {
+        const TokenSpan* w = &spans[b];
+        if (w->is_space) continue;
+        if (w->len <= PACKED_WORD_MAX) {
+            keys[b] = pack_key_within(&data[w->start], w->len, end_pos - w->start);
+            CX_PREFETCH(&dict->words8.slots[packed_slot(keys[b].lo, dict->words8.mask)]);
+        } else if (w->len <= PACKED_KEY_MAX) {
+            keys[b] = pack_key_within(&data[w->start], w->len, end_pos - w->start);
+            CX_PREFETCH(&dict->words16.slots[packed16_slot(keys[b].lo, keys[b].hi, dict->words16.mask)]);
+        } else {
+            keys[b] = (PackedKey){ 0, 0 };
+        }
+    }
+}
+
+// Compress one delimiter-aligned span of input into buffer[0, out_cap), returning the bytes
+// written. Stops before the first token whose output doesn't fit; *next_pos is where to resume.
+size_t compress_span(const char* input_buffer, size_t start_pos, size_t end_pos,
+                     char escape_char, const Dictionary* dict, char* buffer, size_t out_cap, size_t* next_pos) {
+    if (use_trie) {
+        return compress_span_trie(input_buffer, start_pos, end_pos, escape_char, dict, buffer, out_cap, next_pos);
+    }
+    size_t out_pos = 0;
+    size_t i = start_pos, scan = start_pos;
+    TransformStats stats = { 0 };
+    TokenSpan spans[TOKEN_BLOCK];
+    PackedKey keys[TOKEN_BLOCK];
+    DelimiterScanner scanner;
+    scanner_init(&scanner, input_buffer, end_pos);
+    double mark = print_stats ? omp_get_wtime() : 0;
+    bool stalled = false;
+
+    while (i < end_pos && !stalled) {
+        size_t n = tokenize_block(&scanner, &scan, spans);
+        stats.tokenize_seconds += stage_seconds(&mark);
+        if (dict->batch_words) {
+            prefetch_words(dict, input_buffer, end_pos, spans, n, keys);
+            stats.prefetch_seconds += stage_seconds(&mark);
+            stats.prefetched_blocks++;
+        }
+
+        for (size_t b = 0; b < n && !stalled; b++) {
+            const TokenSpan* w = &spans[b];
+            if (w->is_space) {
+                stalled = !copy_delimiters(input_buffer, end_pos, &i, w->start + w->len, buffer, out_cap, &out_pos);
+                continue;
+            }
+            PackedKey key = { 0, 0 };
+            if (dict->batch_words) {
+                key = keys[b];
+            } else if (w->len <= PACKED_KEY_MAX) {
+                key = pack_key_within(&input_buffer[w->start], w->len, end_pos - w->start);
+            }
+            stalled = !compress_word(dict, &input_buffer[w->start], w->len, end_pos - w->start, key, escape_char,
+                                     buffer, out_cap, &out_pos, &stats);
+            if (!stalled) i = w->start + w->len;
+        }
+        stats.resolve_seconds += stage_seconds(&mark);
+    }
+    add_transform_stats(&stats);
+    *next_pos = i;
+    return out_pos;
+}
+
+// Resolve one token, with `readable` bytes of input from token_ptr on, and write its word, or
+// the literal without its escape, at buffer[*out_pos]; false, writing nothing, when that doesn't
+// fit. `key` packs the token when it is looked up in the packed tables.
+static inline bool decompress_token(const Dictionary* dict, const char* token_ptr, size_t token_len,
+                                    size_t readable, PackedKey key, char escape_char, char* buffer, size_t out_cap,
+                                    size_t* out_pos, TransformStats* stats) {
+    bool is_escaped = (token_ptr[0] == escape_char);
+    const char* actual_token = is_escaped ? token_ptr + 1 : token_ptr;
+    size_t actual_len = token_len - (is_escaped ? 1 : 0);
+
+    // Resolve the token: symbols of 1-3 bytes through the hot and then the full short-symbol
+    // index, which may carry the word inline; longer ones through the packed tables, where a
+    // miss is final, and past PACKED_KEY_MAX bytes the hash
+    const DictShortSlot* slot = NULL;
+    uint32_t entry = 0, value = 0;
+    bool hot = false;
+    if (!is_escaped && actual_len <= 3) {
+        slot = short_symbol_slot(&dict->hot_symbols, actual_token, actual_len);
+        hot = slot != NULL;
+        if (!slot) slot = short_symbol_slot(&dict->short_symbols, actual_token, actual_len);
+        if (slot) entry = slot->entry & SHORT_ENTRY_MASK;
+    } else if (!is_escaped && actual_len <= PACKED_KEY_MAX) {
+        if (actual_len <= PACKED_WORD_MAX) {
+            const DictPackedSlot* hit = packed8_find(&dict->symbols8, key);
+            if (hit) { entry = hit->entry; value = hit->value; }
+        } else {
+            const DictPacked16Slot* hit = packed16_find(&dict->symbols16, key);
+            if (hit) { entry = hit->entry; value = hit->value; }
+        }
+    } else if (!is_escaped) {
+        const DictImageEntry* found = dict_find(dict, true, actual_token, actual_len);
+        if (found) entry = (uint32_t)(found - dict->entries) + 1;
+    }
+
+    size_t out = *out_pos;
+    if (slot && slot->entry >> 24) {
+        size_t repl_len = slot->entry >> 24;
+        if (repl_len > out_cap - out) return false;
+        // With room for it, the inline word is stored whole, as with copy_short()
+        if (out_cap - out >= sizeof(slot->word)) memcpy(&buffer[out], &slot->word, sizeof(slot->word));
+        else memcpy(&buffer[out], &slot->word, repl_len);
+        out += repl_len;
+    } else if (value) {
+        if ((value >> 24) > out_cap - out) return false;
+        out += emit_packed_value(&buffer[out], out_cap - out, value);
+    } else if (entry) {
+        const DictImageEntry* e = &dict->entries[entry - 1];
+        if (e->word_len > out_cap - out) return false;
+        copy_short(&buffer[out], out_cap - out, dict->pool + e->word_offset, dict->pool_size - e->word_offset,
+                   e->word_len);
+        out += e->word_len;
+    } else {
+        if (actual_len > out_cap - out) return false;
+        copy_short(&buffer[out], out_cap - out, actual_token, readable - is_escaped, actual_len);
+        out += actual_len;
+    }
+    *out_pos = out;
+    stats->words++;
+    stats->hits += entry != 0;
+    stats->hot_hits += hot;
+    return true;
+}
+
+// Pack the keys of the symbols in spans[0, n) that the packed tables resolve, and prefetch
+// the slots they, and those of 1-3 bytes in the short index, will probe; escaped literals get
+// neither
+static void prefetch_symbols(const Dictionary* dict, const char* data, size_t end_pos, char escape_char,
+                             const TokenSpan* spans, size_t n, PackedKey* keys) {
+    for (size_t b = 0; b < n; b++) {
+        const TokenSpan* t = &spans[b];
+        if (t->is_space || data[t->start] == escape_char) continue;
+        if (t->len <= 3) {
+            uint32_t key = pack_short_symbol(&data[t->start], t->len);
+            CX_PREFETCH(&dict->short_symbols.slots[short_slot(key, dict->short_symbols.mask)]);
+        } else if (t->len <= PACKED_WORD_MAX) {
+            keys[b] = pack_key_within(&data[t->start], t->len, end_pos - t->start);
+            CX_PREFETCH(&dict->symbols8.slots[packed_slot(keys[b].lo, dict->symbols8.mask)]);
+        } else if (t->len <= PACKED_KEY_MAX) {
+            keys[b] = pack_key_within(&data[t->start], t->len, end_pos - t->start);
+            CX_PREFETCH(&dict->symbols16.slots[packed16_slot(keys[b].lo, keys[b].hi, dict->symbols16.mask)]);
+        }
+    }
+}
+
+// Decompress one delimiter-aligned span of transformed data into buffer[0, out_cap), with the
+// same contract as compress_span()
+size_t decompress_span(const char* data, size_t start_pos, size_t end_pos,
+                       char escape_char, const Dictionary* dict, char* buffer, size_t out_cap, size_t* next_pos) {
+    size_t out_pos = 0;
+    size_t i = start_pos, scan = start_pos;
+    TransformStats stats = { 0 };
+    TokenSpan spans[TOKEN_BLOCK];
+    PackedKey keys[TOKEN_BLOCK];
+    DelimiterScanner scanner;
+    scanner_init(&scanner, data, end_pos);
+    double mark = print_stats ? omp_get_wtime() : 0;
+    bool stalled = false;
+
+    while (i < end_pos && !stalled) {
+        size_t n = tokenize_block(&scanner, &scan, spans);
+        stats.tokenize_seconds += stage_seconds(&mark);
+        if (dict->batch_symbols) {
+            prefetch_symbols(dict, data, end_pos, escape_char, spans, n, keys);
+            stats.prefetch_seconds += stage_seconds(&mark);
+            stats.prefetched_blocks++;
+        }
+
+        for (size_t b = 0; b < n && !stalled; b++) {
+            const TokenSpan* t = &spans[b];
+            if (t->is_space) {
+                stalled = !copy_delimiters(data, end_pos, &i, t->start + t->len, buffer, out_cap, &out_pos);
+                continue;
+            }
+            PackedKey key = { 0, 0 };
+            if (data[t->start] != escape_char && t->len > 3 && t->len <= PACKED_KEY_MAX) {
+                key = dict->batch_symbols ? keys[b] : pack_key_within(&data[t->start], t->len, end_pos - t->start);
+            }
+            stalled = !decompress_token(dict, &data[t->start], t->len, end_pos - t->start, key, escape_char, buffer,
+                                        out_cap, &out_pos, &stats);
+            if (!stalled) i = t->start + t->len;
+        }
+        stats.resolve_seconds += stage_seconds(&mark);
+    }
+    add_transform_stats(&stats);
+    *next_pos = i;
+    return out_pos;
+}
+
+typedef size_t (*SpanTransform)(const char* input, size_t start_pos, size_t end_pos,
+                                char escape_char, const Dictionary* dict, char* buffer, size_t out_cap,
+                                size_t* next_pos);
+
+// Transform output kept as a chain of chunks that grows as output arrives, instead of a
+// buffer reserved for the worst-case expansion up front, so memory tracks the real output size.
+// Standard-size chunks go back to a shared pool when released and are reused by later
+// segments, blocks and batches rather than faulting in fresh pages.
+#define OUT_CHUNK_SIZE (256 << 10)
+
+typedef struct OutChunk {
+    struct OutChunk* next;
+    size_t len;
+    size_t cap;
+    char data[];
+} OutChunk;
+
+typedef struct {
+    OutChunk* head;
+    OutChunk* tail;
+    size_t total;
+} OutBuf;
+
+static OutChunk* chunk_pool = NULL;
+
+// Append a chunk able to hold at least min_cap bytes
+static OutChunk* outbuf_add_chunk(OutBuf* out, size_t min_cap) {
+    OutChunk* chunk = NULL;
+    if (min_cap <= OUT_CHUNK_SIZE) {
+        #pragma omp critical(chunk_pool)
+        {
+            chunk = chunk_pool;
+            if (chunk) chunk_pool = chunk->next;
+        }
+        min_cap = OUT_CHUNK_SIZE;
+    }
+    if (!chunk) {
+        chunk = malloc(sizeof(OutChunk) + min_cap);
+        if (!chunk) { fprintf(stderr, "Memory allocation failed for output buffer\n"); exit(1); }
+        chunk->cap = min_cap;
+    }
+    chunk->next = NULL;
+    chunk->len = 0;
+    if (out->tail) out->tail->next = chunk;
+    else out->head = chunk;
+    out->tail = chunk;
+    return chunk;
+}
+
+// Return every chunk of `out` to the pool (oversized ones to the allocator) and empty it
+static void outbuf_release(OutBuf* out) {
+    OutChunk* chunk = out->head;
+    while (chunk) {
+        OutChunk* next = chunk->next;
+        if (chunk->cap == OUT_CHUNK_SIZE) {
+            #pragma omp critical(chunk_pool)
+            {
+                chunk->next = chunk_pool;
+                chunk_pool = chunk;
+            }
+        } else {
+            free(chunk);
+        }
+        chunk = next;
+    }
+    out->head = out->tail = NULL;
+    out->total = 0;
+}
+
+// Free the pooled chunks; only call while no transform is running
+static void chunk_pool_drain(void) {
+    while (chunk_pool) {
+        OutChunk* next = chunk_pool->next;
+        free(chunk_pool);
+        chunk_pool = next;
+    }
+}
+
+// Append raw bytes such as block headers or passed-through input
+static void outbuf_append(OutBuf* out, const char* data, size_t len) {
+    while (len > 0) {
+        OutChunk* chunk = out->tail;
+        if (!chunk || chunk->len == chunk->cap) chunk = outbuf_add_chunk(out, 0);
+        size_t n = chunk->cap - chunk->len;
+        if (n > len) n = len;
+        memcpy(chunk->data + chunk->len, data, n);
+        chunk->len += n;
+        out->total += n;
+        data += n;
+        len -= n;
+    }
+}
+
+// Run `transform` over input[start, end) into `out`, adding chunks as they fill
+static void outbuf_transform(OutBuf* out, SpanTransform transform, const char* input, size_t start, size_t end,
+                             char escape_char, const Dictionary* dict) {
+    size_t pos = start;
+    while (pos < end) {
+        OutChunk* chunk = out->tail;
+        if (!chunk || chunk->len == chunk->cap) chunk = outbuf_add_chunk(out, 0);
+        size_t next_pos;
+        size_t written = transform(input, pos, end, escape_char, dict,
+                                   chunk->data + chunk->len, chunk->cap - chunk->len, &next_pos);
+        chunk->len += written;
+        out->total += written;
+        if (next_pos == pos) {
+            // The next token didn't fit in what was left of the chunk. Its output is at most
+            // the token plus an escape, or a dictionary entry, so this chunk is sure to hold it.
+            size_t token_end = pos;
+            while (token_end < end && !is_delimiter(input[token_end])) token_end++;
+            size_t need = token_end - pos + MAX_LINE;
+            if (chunk->len == 0 && chunk->cap >= need) {
+                fprintf(stderr, "Transform made no progress\n");
+                exit(1);
+            }
+            outbuf_add_chunk(out, need);
+        }
+        pos = next_pos;
+    }
+}
+
+// Write `out` at `offset` of a positional output
+static void outbuf_write_at(ParallelOutput* dest, const OutBuf* out, uint64_t offset) {
+    for (const OutChunk* chunk = out->head; chunk; chunk = chunk->next) {
+        write_at(dest, chunk->data, chunk->len, offset);
+        offset += chunk->len;
+    }
+}
+
+static void outbuf_fwrite(const OutBuf* out, FILE* file) {
+    for (const OutChunk* chunk = out->head; chunk; chunk = chunk->next) {
+        fwrite(chunk->data, 1, chunk->len, file);
+    }
+}
+
+// The raw-format transforms cut their input into many delimiter-aligned chunks, about
+// SCHED_CHUNKS_PER_THREAD per thread, within [SCHED_CHUNK_MIN, SCHED_CHUNK_MAX] bytes. Threads
+// take the next chunk as they finish one (OpenMP's dynamic schedule is a shared queue), so a
+// stretch that is slow to transform holds up one chunk instead of a whole 1/threads of the input.
+#define SCHED_CHUNKS_PER_THREAD 8
+#define SCHED_CHUNK_MIN MIN_WINDOW
+#define SCHED_CHUNK_MAX (1 << 20)
+
+// threads=auto: the thread count given is what the host allows, and transforms trim it to
+// their work, which is measured on the first chunk: each thread should get at least
+// AUTO_MIN_THREAD_SECONDS of it, or starting the thread costs more than it saves
+#define AUTO_MIN_THREAD_SECONDS 0.002
+bool auto_threads = false;
+static int auto_threads_chosen = 0;
+
+// CPUs this process may use: those in its affinity mask, narrowed by a cgroup CPU quota
+static int available_cpus(void) {
+    int cpus = omp_get_num_procs();
+#ifdef __linux__
+    // cgroup v2 keeps the quota in cpu.max of the process's group ("<quota> <period>", or "max"
+    // for none); v1 in the cpu controller's cfs files
+    unsigned long long quota = 0, period = 0;
+    char path[512] = "/sys/fs/cgroup/cpu.max";
+    FILE* f = fopen("/proc/self/cgroup", "r");
+    if (f) {
+        char line[400];
+        while (fgets(line, sizeof(line), f)) {
+            if (strncmp(line, "0::", 3) != 0) continue;
+            line[strcspn(line, "\n")] = 0;
+            snprintf(path, sizeof(path), "/sys/fs/cgroup%s/cpu.max", line + 3);
+            break;
+        }
+        fclose(f);
+    }
+    f = fopen(path, "r");
+    if (!f) f = fopen("/sys/fs/cgroup/cpu.max", "r");
+    if (f) {
+        char limit[32];
+        if (fscanf(f, "%31s %llu", limit, &period) == 2 && strcmp(limit, "max") != 0) quota = strtoull(limit, NULL, 10);
+        fclose(f);
+    } else if ((f = fopen("/sys/fs/cgroup/cpu/cpu.cfs_quota_us", "r"))) {
+        long long v1_quota = -1;
+        if (fscanf(f, "%lld", &v1_quota) == 1 && v1_quota > 0) quota = (unsigned long long)v1_quota;
+        fclose(f);
+        if (quota && (f = fopen("/sys/fs/cgroup/cpu/cpu.cfs_period_us", "r"))) {
+            if (fscanf(f, "%llu", &period) != 1) period = 0;
+            fclose(f);
+        }
+    }
+    if (quota && period) {
+        unsigned long long allowed = (quota + period - 1) / period;
+        if (allowed < (unsigned long long)cpus) cpus = (int)allowed;
+    }
+#endif
+    return cpus > 0 ? cpus : 1;
+}
+
+static void print_auto_threads(int threads, int cpus) {
+    fprintf(stderr, "Threads:          %d (auto, %d CPU%s available)\n", threads, cpus, cpus == 1 ? "" : "s");
+}
+
+// Threads worth starting for `chunks` more chunks that cost about `chunk_seconds` each
+static int auto_thread_count(int limit, size_t chunks, double chunk_seconds) {
+    double threads = chunk_seconds * (double)chunks / AUTO_MIN_THREAD_SECONDS;
+    if (threads > (double)chunks) threads = (double)chunks;
+    if (threads > limit) threads = limit;
+    return threads < 1 ? 1 : (int)threads;
+}
+
+// Cut data[0, len) into delimiter-aligned chunks for `threads` threads
+static size_t plan_chunks(const char* data, size_t len, int threads, size_t** bounds_out) {
+    size_t chunk = len / ((size_t)threads * SCHED_CHUNKS_PER_THREAD);
+    if (chunk < SCHED_CHUNK_MIN) chunk = SCHED_CHUNK_MIN;
+    if (chunk > SCHED_CHUNK_MAX) chunk = SCHED_CHUNK_MAX;
+    size_t capacity = len / chunk + 2;
+    size_t* bounds = malloc(sizeof(size_t) * capacity);
+    if (!bounds) { fprintf(stderr, "Memory allocation failed for chunk plan\n"); exit(1); }
+    size_t count = 0, pos = 0;
+    bounds[0] = 0;
+    while (pos < len) {
+        // Chunks only ever grow to reach a delimiter, so there are never more than capacity - 1
+        size_t end = (len - pos > chunk) ? pos + chunk : len;
+        while (end < len && !is_delimiter(data[end])) end++;
+        bounds[++count] = end;
+        pos = end;
+    }
+    *bounds_out = bounds;
+    return count;
+}
+
+// Transform data[0, len) chunk by chunk over up to `threads` threads and write the output from
+// `base` of `out`; returns where the output ends
+static uint64_t transform_chunked(ParallelOutput* out, SpanTransform transform, const char* data, size_t len,
+                                  char escape_char, const Dictionary* dict, int threads, uint64_t base) {
+    size_t* bounds = NULL;
+    size_t count = plan_chunks(data, len, threads, &bounds);
+    OutBuf* outs = calloc(count ? count : 1, sizeof(OutBuf));
+    uint64_t* offsets = malloc(sizeof(uint64_t) * (count + 1));
+    if (!outs || !offsets) { fprintf(stderr, "Memory allocation failed for chunk outputs\n"); exit(1); }
+
+    size_t first = 0;
+    if (auto_threads && count > 0) {
+        double start = omp_get_wtime();
+        outbuf_transform(&outs[0], transform, data, bounds[0], bounds[1], escape_char, dict);
+        threads = auto_thread_count(threads, count - 1, omp_get_wtime() - start);
+        auto_threads_chosen = threads;
+        first = 1;
+    }
+
+    #pragma omp parallel for num_threads(threads) schedule(dynamic)
+    for (size_t c = first; c < count; c++) {
+        outbuf_transform(&outs[c], transform, data, bounds[c], bounds[c + 1], escape_char, dict);
+    }
+
+    uint64_t pos = base;
+    for (size_t c = 0; c < count; c++) {
+        offsets[c] = pos;
+        pos += outs[c].total;
+    }
+    if (out->fd >= 0) {
+        #pragma omp parallel for num_threads(threads) schedule(dynamic)
+        for (size_t c = 0; c < count; c++) {
+            outbuf_write_at(out, &outs[c], offsets[c]);
+            outbuf_release(&outs[c]);
+        }
+    } else {
+        for (size_t c = 0; c < count; c++) {
+            outbuf_fwrite(&outs[c], out->file);
+            outbuf_release(&outs[c]);
+        }
+    }
+    chunk_pool_drain();
+
+    free(offsets);
+    free(outs);
+    free(bounds);
+    return pos;
+}
+
+void compress(const char* dict_path, const char* lang_path, const char* input_buffer, size_t input_len, int threads, const char* output_path) {
+    // Load dict once
+    Dictionary dict = load_dictionary(dict_path, lang_path);
+    char escape_char = find_unused_char_from_buffer(input_buffer, input_len);
+
+    ParallelOutput out = open_parallel_output(output_path, "compressed");
+    fputc(escape_char, out.file);
+
+    uint64_t end = transform_chunked(&out, compress_span, input_buffer, input_len, escape_char, &dict, threads, 1);
+    close_parallel_output(&out, end);
+    free_dictionary(&dict);
+}
+
+void decompress(const char* dict_path, const char* lang_path,
+                           const char* input_buffer, size_t input_len, int threads, const char* output_path) {
+    if (input_len < 1) return;
+
+    Dictionary dict = load_dictionary(lang_path, dict_path);
+
+    char escape_char = input_buffer[0];
+    const char* data = input_buffer + 1;
+    size_t data_len = input_len - 1;
+
+    ParallelOutput out = open_parallel_output(output_path, "decompressed");
+    uint64_t end = transform_chunked(&out, decompress_span, data, data_len, escape_char, &dict, threads, 0);
+    close_parallel_output(&out, end);
+    free_dictionary(&dict);
+}
+
+// Framed container layout, all integers little-endian:
+//   header   "\0CXF" version(1) reserved(3)
+//   block    escape(1) comp_len(4) orig_len(4) payload[comp_len]    repeated per block
+//   end      a block header of nine zero bytes
+//   index    offset(8) comp_len(4) orig_len(4)                      one entry per block
+//   trailer  index_offset(8) block_count(4) "CXFI"
+// Every block is transformed with its own escape byte, so blocks decode independently and
+// to a size known up front; escape 0 marks a stored block whose payload is the original bytes.
+// The raw format's first byte is its escape character, which is never NUL, so the two
+// formats are told apart by the first byte alone.
+#define FRAME_MAGIC "\0CXF"
+#define FRAME_INDEX_MAGIC "CXFI"
+#define FRAME_VERSION 1
+#define FRAME_HEADER_SIZE 8
+#define BLOCK_HEADER_SIZE 9
+#define INDEX_ENTRY_SIZE 16
+#define TRAILER_SIZE 16
+
+#define DEFAULT_BLOCK_SIZE (1 << 20)
+#define MAX_BLOCK_SIZE (1u << 30)
+
+typedef struct {
+    uint64_t offset;      // of the block header within the container
+    uint64_t orig_offset; // of the block's first byte within the original data
+    uint32_t comp_len;
+    uint32_t orig_len;
+    char escape_char;
+} BlockInfo;
+
+static void put_u32(unsigned char* p, uint32_t v) {
+    for (int i = 0; i < 4; i++) p[i] = (unsigned char)(v >> (8 * i));
+}
+
+static void put_u64(unsigned char* p, uint64_t v) {
+    for (int i = 0; i < 8; i++) p[i] = (unsigned char)(v >> (8 * i));
+}
+
+static uint32_t get_u32(const unsigned char* p) {
+    uint32_t v = 0;
+    for (int i = 0; i < 4; i++) v |= (uint32_t)p[i] << (8 * i);
+    return v;
+}
+
+static uint64_t get_u64(const unsigned char* p) {
+    uint64_t v = 0;
+    for (int i = 0; i < 8; i++) v |= (uint64_t)p[i] << (8 * i);
+    return v;
+}
+
+bool is_framed(const char* buffer, size_t len) {
+    return len >= 4 && memcmp(buffer, FRAME_MAGIC, 4) == 0;
+}
+
+static void write_frame_header(FILE* out) {
+    unsigned char header[FRAME_HEADER_SIZE] = { 0, 'C', 'X', 'F', FRAME_VERSION, 0, 0, 0 };
+    fwrite(header, 1, sizeof(header), out);
+}
+
+static void write_block_header(FILE* out, char escape_char, uint32_t comp_len, uint32_t orig_len) {
+    unsigned char header[BLOCK_HEADER_SIZE];
+    header[0] = (unsigned char)escape_char;
+    put_u32(header + 1, comp_len);
+    put_u32(header + 5, orig_len);
+    fwrite(header, 1, sizeof(header), out);
+}
+
+// Write the end marker, block index and trailer; `pos` is the current container offset
+static void write_frame_end(FILE* out, const BlockInfo* blocks, size_t count, uint64_t pos) {
+    write_block_header(out, 0, 0, 0);
+    uint64_t index_offset = pos + BLOCK_HEADER_SIZE;
+    for (size_t b = 0; b < count; b++) {
+        unsigned char entry[INDEX_ENTRY_SIZE];
+        put_u64(entry, blocks[b].offset);
+        put_u32(entry + 8, blocks[b].comp_len);
+        put_u32(entry + 12, blocks[b].orig_len);
+        fwrite(entry, 1, sizeof(entry), out);
+    }
+    unsigned char trailer[TRAILER_SIZE];
+    put_u64(trailer, index_offset);
+    put_u32(trailer + 8, (uint32_t)count);
+    memcpy(trailer + 12, FRAME_INDEX_MAGIC, 4);
+    fwrite(trailer, 1, sizeof(trailer), out);
+}
+
+static void corrupt_container(void) {
+    fprintf(stderr, "Corrupt or truncated CXcompress container\n");
+    exit(1);
+}
+
+// Validate a framed container and load its block table, exiting on any inconsistency
+static BlockInfo* read_frame_index(const char* buffer, size_t len, size_t* count_out, uint64_t* total_out) {
+    const unsigned char* data = (const unsigned char*)buffer;
+    if (len < FRAME_HEADER_SIZE + BLOCK_HEADER_SIZE + TRAILER_SIZE || !is_framed(buffer, len)) corrupt_container();
+    if (data[4] != FRAME_VERSION) {
+        fprintf(stderr, "Unsupported container version %d\n", data[4]);
+        exit(1);
+    }
+
+    const unsigned char* trailer = data + len - TRAILER_SIZE;
+    if (memcmp(trailer + 12, FRAME_INDEX_MAGIC, 4) != 0) corrupt_container();
+    uint64_t index_offset = get_u64(trailer);
+    size_t count = get_u32(trailer + 8);
+    if (count > len / INDEX_ENTRY_SIZE ||
+        index_offset != len - TRAILER_SIZE - (uint64_t)count * INDEX_ENTRY_SIZE ||
+        index_offset < FRAME_HEADER_SIZE + BLOCK_HEADER_SIZE) corrupt_container();
+    uint64_t blocks_end = index_offset - BLOCK_HEADER_SIZE;
+
+    BlockInfo* blocks = malloc(sizeof(BlockInfo) * (count ? count : 1));
+    if (!blocks) { fprintf(stderr, "Memory allocation failed for block index\n"); exit(1); }
+    uint64_t total = 0;
+    for (size_t b = 0; b < count; b++) {
+        const unsigned char* entry = data + index_offset + b * INDEX_ENTRY_SIZE;
+        BlockInfo* info = &blocks[b];
+        info->offset = get_u64(entry);
+        info->comp_len = get_u32(entry + 8);
+        info->orig_len = get_u32(entry + 12);
+        info->orig_offset = total;
+        if (info->offset < FRAME_HEADER_SIZE || info->offset > blocks_end ||
+            blocks_end - info->offset < BLOCK_HEADER_SIZE + (uint64_t)info->comp_len) corrupt_container();
+        const unsigned char* header = data + info->offset;
+        info->escape_char = (char)header[0];
+        if (get_u32(header + 1) != info->comp_len || get_u32(header + 5) != info->orig_len) corrupt_container();
+        total += info->orig_len;
+    }
+
+    *count_out = count;
+    *total_out = total;
+    return blocks;
+}
+
+// Cut input[0, len) into blocks of about block_size bytes. Each block is extended to the next
+// delimiter when one comes within another block_size bytes; otherwise it is cut mid-token,
+// which is safe because blocks are transformed independently.
+static size_t plan_blocks(const char* input, size_t len, size_t block_size, size_t** bounds_out) {
+    size_t capacity = len / block_size + 2;
+    size_t* bounds = malloc(sizeof(size_t) * capacity);
+    if (!bounds) { fprintf(stderr, "Memory allocation failed for block plan\n"); exit(1); }
+    size_t count = 0;
+    size_t pos = 0;
+    bounds[0] = 0;
+    while (pos < len) {
+        size_t end = (len - pos > block_size) ? pos + block_size : len;
+        size_t limit = (len - end > block_size) ? end + block_size : len;
+        size_t cut = end;
+        while (cut < limit && !is_delimiter(input[cut])) cut++;
+        if (cut < limit || limit == len) end = cut;
+        if (count + 2 > capacity) {
+            capacity *= 2;
+            size_t* grown = realloc(bounds, sizeof(size_t) * capacity);
+            if (!grown) { fprintf(stderr, "Memory allocation failed for block plan\n"); exit(1); }
+            bounds = grown;
+        }
+        bounds[++count] = end;
+        pos = end;
+    }
+    *bounds_out = bounds;
+    return count;
+}
+
+// Append one block, header and payload, for input[start, end) to `out` and fill in its sizes
+// and escape byte. Falls back to a stored block when no escape byte is free or the payload
+// would outgrow the 32-bit length field.
+static void compress_block(const char* input, size_t start, size_t end, const Dictionary* dict,
+                           OutBuf* out, BlockInfo* info) {
+    bool used[256] = {0};
+    mark_used_chars(used, input + start, end - start);
+    char escape_char = pick_unused_char(used);
+
+    unsigned char header[BLOCK_HEADER_SIZE] = {0};
+    outbuf_append(out, (const char*)header, BLOCK_HEADER_SIZE);
+    if (escape_char) {
+        outbuf_transform(out, compress_span, input, start, end, escape_char, dict);
+        if (out->total - BLOCK_HEADER_SIZE > UINT32_MAX) {
+            outbuf_release(out);
+            outbuf_append(out, (const char*)header, BLOCK_HEADER_SIZE);
+            escape_char = 0;
+        }
+    }
+    if (!escape_char) outbuf_append(out, input + start, end - start);
+
+    info->escape_char = escape_char;
+    info->orig_len = (uint32_t)(end - start);
+    info->comp_len = (uint32_t)(out->total - BLOCK_HEADER_SIZE);
+    // The header is the first thing in the chain, and the first chunk is far bigger than it
+    unsigned char* dest = (unsigned char*)out->head->data;
+    dest[0] = (unsigned char)escape_char;
+    put_u32(dest + 1, info->comp_len);
+    put_u32(dest + 5, info->orig_len);
+}
+
+// Decode one block payload into exactly orig_len bytes at `out`; false if the block is corrupt
+static bool decompress_block(const char* payload, uint32_t comp_len, uint32_t orig_len,
+                             char escape_char, const Dictionary* dict, char* out) {
+    if (!escape_char) {
+        if (comp_len != orig_len) return false;
+        memcpy(out, payload, orig_len);
+        return true;
+    }
+    size_t next_pos;
+    return decompress_span(payload, 0, comp_len, escape_char, dict, out, orig_len, &next_pos) == orig_len &&
+           next_pos == comp_len;
+}
+
+void compress_framed(const char* dict_path, const char* lang_path, const char* input_buffer, size_t input_len,
+                     int threads, size_t block_size, const char* output_path) {
+    Dictionary dict = load_dictionary(dict_path, lang_path);
+
+    size_t* bounds = NULL;
+    size_t count = plan_blocks(input_buffer, input_len, block_size, &bounds);
+    BlockInfo* blocks = calloc(count ? count : 1, sizeof(BlockInfo));
+    OutBuf* payloads = calloc(count ? count : 1, sizeof(OutBuf));
+    ParallelOutput out = open_parallel_output(output_path, "compressed");
+    uint64_t pos = FRAME_HEADER_SIZE;
+
+    #pragma omp parallel num_threads(threads)
+    {
+        #pragma omp for schedule(dynamic)
+        for (size_t b = 0; b < count; b++) {
+            compress_block(input_buffer, bounds[b], bounds[b + 1], &dict, &payloads[b], &blocks[b]);
+        }
+
+        #pragma omp single
+        for (size_t b = 0; b < count; b++) {
+            blocks[b].offset = pos;
+            pos += BLOCK_HEADER_SIZE + blocks[b].comp_len;
+        }
+
+        if (out.fd >= 0) {
+            #pragma omp for schedule(dynamic)
+            for (size_t b = 0; b < count; b++) {
+                outbuf_write_at(&out, &payloads[b], blocks[b].offset);
+                outbuf_release(&payloads[b]);
+            }
+        }
+    }
+
+    write_frame_header(out.file);
+    if (out.fd >= 0) {
+        // The trailer goes after the positional writes; fd is only set where off_t seeks exist
+#ifdef CX_HAVE_PWRITE
+        if (fseeko(out.file, (off_t)pos, SEEK_SET) != 0) out.failed = true;
+#endif
+    } else {
+        for (size_t b = 0; b < count; b++) {
+            outbuf_fwrite(&payloads[b], out.file);
+            outbuf_release(&payloads[b]);
+        }
+    }
+    write_frame_end(out.file, blocks, count, pos);
+    close_parallel_output(&out, pos + BLOCK_HEADER_SIZE + (uint64_t)count * INDEX_ENTRY_SIZE + TRAILER_SIZE);
+
+    chunk_pool_drain();
+    free(payloads);
+    free(blocks);
+    free(bounds);
+    free_dictionary(&dict);
+}
+
+// Decode bytes [range_start, range_start + range_len) of the original data from a framed
+// container, touching only the blocks that overlap the range. A full decode is the range
+// [0, UINT64_MAX).
+void decompress_framed(const char* dict_path, const char* lang_path, const char* input_buffer, size_t input_len,
+                       int threads, uint64_t range_start, uint64_t range_len, const char* output_path) {
+    size_t count = 0;
+    uint64_t total = 0;
+    BlockInfo* blocks = read_frame_index(input_buffer, input_len, &count, &total);
+
+    if (range_start > total) range_start = total;
+    uint64_t range_end = (range_len > total - range_start) ? total : range_start + range_len;
+
+    size_t first = 0;
+    while (first < count && blocks[first].orig_offset + blocks[first].orig_len <= range_start) first++;
+    size_t last = first;
+    while (last < count && blocks[last].orig_offset < range_end) last++;
+
+    Dictionary dict;
+    memset(&dict, 0, sizeof(dict));
+    if (last > first) dict = load_dictionary(lang_path, dict_path);
+
+    ParallelOutput out = open_parallel_output(output_path, "decompressed");
+    bool corrupt = false;
+
+    if (out.fd >= 0) {
+        // Each thread decodes a block into its own scratch buffer and writes the part of it
+        // inside the range straight to its final offset
+        #pragma omp parallel num_threads(threads)
+        {
+            char* scratch = NULL;
+            size_t scratch_cap = 0;
+            #pragma omp for schedule(dynamic)
+            for (size_t b = first; b < last; b++) {
+                const BlockInfo* info = &blocks[b];
+                if (scratch_cap < info->orig_len) {
+                    free(scratch);
+                    scratch_cap = info->orig_len;
+                    scratch = malloc(scratch_cap);
+                    if (!scratch) { fprintf(stderr, "Memory allocation failed for block scratch\n"); exit(1); }
+                }
+                if (!decompress_block(input_buffer + info->offset + BLOCK_HEADER_SIZE, info->comp_len, info->orig_len,
+                                      info->escape_char, &dict, scratch)) {
+                    corrupt = true;
+                    continue;
+                }
+                uint64_t lo = (info->orig_offset > range_start) ? info->orig_offset : range_start;
+                uint64_t hi = info->orig_offset + info->orig_len;
+                if (hi > range_end) hi = range_end;
+                if (hi > lo) write_at(&out, scratch + (lo - info->orig_offset), hi - lo, lo - range_start);
+            }
+            free(scratch);
+        }
+    } else {
+        uint64_t base = (first < count) ? blocks[first].orig_offset : total;
+        uint64_t span = (last > first) ? blocks[last - 1].orig_offset + blocks[last - 1].orig_len - base : 0;
+        if (span > SIZE_MAX - 1) { fprintf(stderr, "Decompressed range is too large\n"); exit(1); }
+
+        char* output = malloc(span ? span : 1);
+        if (!output) { fprintf(stderr, "Memory allocation failed for decompressed output\n"); exit(1); }
+
+        #pragma omp parallel for num_threads(threads) schedule(dynamic)
+        for (size_t b = first; b < last; b++) {
+            const BlockInfo* info = &blocks[b];
+            if (!decompress_block(input_buffer + info->offset + BLOCK_HEADER_SIZE, info->comp_len, info->orig_len,
+                                  info->escape_char, &dict, output + (info->orig_offset - base))) {
+                corrupt = true;
+            }
+        }
+        if (!corrupt) fwrite(output + (range_start - base), 1, range_end - range_start, out.file);
+        free(output);
+    }
+    if (corrupt) corrupt_container();
+    close_parallel_output(&out, range_end - range_start);
+
+    free(blocks);
+    if (dict.image) {
+        free_dictionary(&dict);
+    }
+}
+
+// Split input[start, end) into `parts` pieces of roughly equal size, each ending on a delimiter
+static void split_at_delimiters(const char* input, size_t start, size_t end, int parts, size_t* split_points) {
+    size_t bytes_per_part = (end - start + parts - 1) / parts;
+    split_points[0] = start;
+    split_points[parts] = end;
+    for (int t = 1; t < parts; t++) {
+        size_t approx_pos = start + t * bytes_per_part;
+        if (approx_pos > end) approx_pos = end;
+        if (approx_pos < split_points[t - 1]) approx_pos = split_points[t - 1];
+        while (approx_pos < end && !is_delimiter(input[approx_pos])) {
+            approx_pos++;
+        }
+        split_points[t] = approx_pos;
+    }
+}
+
+// Asynchronous stream I/O for the streaming engines. Each engine keeps at most one read and
+// one write in flight: the read of the next batch and the write of the previous one proceed
+// while the OpenMP workers transform the current batch. With io_uring the kernel performs
+// both in the background; the blocking backend performs them on the spot through stdio.
+typedef struct {
+    const void* base;
+    size_t len;
+} IoSlice;
+
+#ifdef CX_HAVE_IO_URING
+#define IO_TAG_READ 1
+#define IO_TAG_WRITE 2
+
+// Minimal io_uring ring driven through the raw system calls
+typedef struct {
+    int fd;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    struct io_uring_sqe* sqes;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_cqe* cqes;
+    void* sq_map;
+    size_t sq_map_len;
+    void* cq_map;
+    size_t cq_map_len;
+    size_t sqes_len;
+} IoRing;
+
+static bool io_ring_init(IoRing* ring, unsigned entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring->fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0) return false;
+    // Reads and writes use offset -1 (the file position) so pipes and stdio stay in step
+    if (!(params.features & IORING_FEAT_RW_CUR_POS)) {
+        close(ring->fd);
+        return false;
+    }
+
+    ring->sq_map_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_map_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sq_map = mmap(NULL, ring->sq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring->fd, IORING_OFF_SQ_RING);
+    ring->cq_map = mmap(NULL, ring->cq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring->fd, IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (ring->sq_map == MAP_FAILED || ring->cq_map == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        close(ring->fd);
+        return false;
+    }
+
+    char* sq = ring->sq_map;
+    char* cq = ring->cq_map;
+    ring->sq_head = (unsigned*)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned*)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned*)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+    return true;
+}
+
+static void io_ring_exit(IoRing* ring) {
+    munmap(ring->sqes, ring->sqes_len);
+    munmap(ring->cq_map, ring->cq_map_len);
+    munmap(ring->sq_map, ring->sq_map_len);
+    close(ring->fd);
+}
+
+static void io_ring_submit(IoRing* ring, int opcode, int fd, const void* addr, unsigned len, uint64_t tag) {
+    unsigned tail = *ring->sq_tail;
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe* sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = (uint8_t)opcode;
+    sqe->fd = fd;
+    sqe->off = (uint64_t)-1;
+    sqe->addr = (uint64_t)(uintptr_t)addr;
+    sqe->len = len;
+    sqe->user_data = tag;
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    while (syscall(__NR_io_uring_enter, ring->fd, 1, 0, 0, NULL, 0) < 0) {
+        if (errno != EINTR) { perror("io_uring_enter"); exit(1); }
+    }
+}
+
+// Block until the next completion arrives and return its tag and result
+static uint64_t io_ring_wait(IoRing* ring, int* result) {
+    unsigned head = *ring->cq_head;
+    while (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        if (syscall(__NR_io_uring_enter, ring->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR) {
+            perror("io_uring_enter");
+            exit(1);
+        }
+    }
+    struct io_uring_cqe* cqe = &ring->cqes[head & *ring->cq_mask];
+    uint64_t tag = cqe->user_data;
+    *result = cqe->res;
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+    return tag;
+}
+#endif
+
+typedef struct {
+    FILE* in;
+    FILE* out;
+    bool read_pending;
+    bool write_pending;
+    char* read_buf;
+    size_t read_want;
+    size_t read_got;
+#ifdef CX_HAVE_IO_URING
+    bool uring;
+    IoRing ring;
+    bool read_done;
+    bool write_done;
+    int read_result;
+    int write_result;
+    struct iovec* iov;
+    int iov_count;
+    int iov_cap;
+#endif
+} StreamIo;
+
+// Set up I/O between `in` and `out`; falls back to blocking stdio when io_uring isn't
+// compiled in or the kernel refuses it. Must run before any other I/O on the two streams.
+static void stream_io_init(StreamIo* io, FILE* in, FILE* out, bool want_uring) {
+    memset(io, 0, sizeof(*io));
+    io->in = in;
+    io->out = out;
+#ifdef CX_HAVE_IO_URING
+    if (want_uring) {
+        io->uring = io_ring_init(&io->ring, 8);
+        if (io->uring) {
+            // Ring reads and writes bypass stdio, so stdio must not buffer ahead or behind them
+            setvbuf(in, NULL, _IONBF, 0);
+            setvbuf(out, NULL, _IONBF, 0);
+        }
+    }
+    if (want_uring && !io->uring) fprintf(stderr, "io_uring unavailable, using blocking I/O\n");
+#else
+    if (want_uring) fprintf(stderr, "io_uring support not compiled in, using blocking I/O\n");
+#endif
+}
+
+#ifdef CX_HAVE_IO_URING
+static void stream_io_submit_read(StreamIo* io) {
+    size_t left = io->read_want - io->read_got;
+    unsigned len = left > (1u << 30) ? (1u << 30) : (unsigned)left;
+    io->read_done = false;
+    io_ring_submit(&io->ring, IORING_OP_READ, fileno(io->in), io->read_buf + io->read_got, len, IO_TAG_READ);
+}
+
+static void stream_io_submit_write(StreamIo* io) {
+    io->write_done = false;
+    io_ring_submit(&io->ring, IORING_OP_WRITEV, fileno(io->out), io->iov, (unsigned)io->iov_count, IO_TAG_WRITE);
+}
+
+// Wait for the in-flight operation tagged `tag`, parking the other one's result if it lands first
+static int stream_io_wait(StreamIo* io, uint64_t tag) {
+    bool* done = (tag == IO_TAG_READ) ? &io->read_done : &io->write_done;
+    while (!*done) {
+        int result;
+        uint64_t got = io_ring_wait(&io->ring, &result);
+        if (got == IO_TAG_READ) { io->read_result = result; io->read_done = true; }
+        else { io->write_result = result; io->write_done = true; }
+    }
+    return (tag == IO_TAG_READ) ? io->read_result : io->write_result;
+}
+#endif
+
+// Start filling buf[0, len) from the input; stream_read_end() collects the result
+static void stream_read_begin(StreamIo* io, char* buf, size_t len) {
+    io->read_buf = buf;
+    io->read_want = len;
+    io->read_got = 0;
+    io->read_pending = true;
+#ifdef CX_HAVE_IO_URING
+    if (io->uring) {
+        if (len > 0) stream_io_submit_read(io);
+        else io->read_done = true;
+        return;
+    }
+#endif
+    size_t got;
+    while (io->read_got < len && (got = fread(buf + io->read_got, 1, len - io->read_got, io->in)) > 0) {
+        io->read_got += got;
+    }
+    if (ferror(io->in)) { fprintf(stderr, "Failed to read input stream\n"); exit(1); }
+}
+
+// Wait for the pending read; returns the bytes read, which is short of the request only at EOF
+static size_t stream_read_end(StreamIo* io) {
+    if (!io->read_pending) return 0;
+    io->read_pending = false;
+#ifdef CX_HAVE_IO_URING
+    if (io->uring) {
+        while (io->read_got < io->read_want) {
+            int result = stream_io_wait(io, IO_TAG_READ);
+            if (result == -EINTR || result == -EAGAIN) { stream_io_submit_read(io); continue; }
+            if (result < 0) { fprintf(stderr, "Failed to read input stream: %s\n", strerror(-result)); exit(1); }
+            if (result == 0) break;
+            io->read_got += (size_t)result;
+            if (io->read_got < io->read_want) stream_io_submit_read(io);
+        }
+    }
+#endif
+    return io->read_got;
+}
+
+// Start writing `count` slices to the output in order; the slices must stay valid until
+// the matching stream_write_end()
+static void stream_write_begin(StreamIo* io, const IoSlice* slices, int count) {
+    io->write_pending = true;
+#ifdef CX_HAVE_IO_URING
+    if (io->uring) {
+        if (count > io->iov_cap) {
+            io->iov = realloc(io->iov, sizeof(struct iovec) * count);
+            if (!io->iov) { fprintf(stderr, "Memory allocation failed for stream buffers\n"); exit(1); }
+            io->iov_cap = count;
+        }
+        io->iov_count = 0;
+        for (int i = 0; i < count; i++) {
+            if (slices[i].len == 0) continue;
+            io->iov[io->iov_count].iov_base = (void*)slices[i].base;
+            io->iov[io->iov_count].iov_len = slices[i].len;
+            io->iov_count++;
+        }
+        if (io->iov_count > 0) stream_io_submit_write(io);
+        else io->write_done = true;
+        return;
+    }
+#endif
+    for (int i = 0; i < count; i++) {
+        fwrite(slices[i].base, 1, slices[i].len, io->out);
+    }
+}
+
+static void stream_write_end(StreamIo* io) {
+    if (!io->write_pending) return;
+    io->write_pending = false;
+#ifdef CX_HAVE_IO_URING
+    if (io->uring) {
+        while (io->iov_count > 0) {
+            int result = stream_io_wait(io, IO_TAG_WRITE);
+            if (result == -EINTR || result == -EAGAIN) { stream_io_submit_write(io); continue; }
+            if (result <= 0) { fprintf(stderr, "Failed to write output: %s\n", strerror(result ? -result : EIO)); exit(1); }
+            // Drop the fully written slices and trim the partial one before resubmitting
+            size_t written = (size_t)result;
+            int first = 0;
+            while (first < io->iov_count && written >= io->iov[first].iov_len) {
+                written -= io->iov[first].iov_len;
+                first++;
+            }
+            if (first < io->iov_count) {
+                io->iov[first].iov_base = (char*)io->iov[first].iov_base + written;
+                io->iov[first].iov_len -= written;
+            }
+            memmove(io->iov, io->iov + first, sizeof(struct iovec) * (io->iov_count - first));
+            io->iov_count -= first;
+            if (io->iov_count > 0) stream_io_submit_write(io);
+        }
+    }
+#endif
+}
+
+static void stream_io_close(StreamIo* io) {
+    stream_read_end(io);
+    stream_write_end(io);
+#ifdef CX_HAVE_IO_URING
+    if (io->uring) io_ring_exit(&io->ring);
+    free(io->iov);
+#endif
+}
+
+// Per-batch output of a streaming engine: one chunked output (or exact-size buffer) per piece
+// plus the slices that hand them to the writer in order
+typedef struct {
+    char** bufs;
+    size_t* caps;
+    size_t* lens;
+    OutBuf* outs;
+    IoSlice* slices;
+    int cap_pieces;
+    int cap_slices;
+} StreamBatch;
+
+static void batch_reserve(StreamBatch* batch, int pieces) {
+    if (pieces <= batch->cap_pieces) return;
+    batch->bufs = realloc(batch->bufs, sizeof(char*) * pieces);
+    batch->caps = realloc(batch->caps, sizeof(size_t) * pieces);
+    batch->lens = realloc(batch->lens, sizeof(size_t) * pieces);
+    batch->outs = realloc(batch->outs, sizeof(OutBuf) * pieces);
+    if (!batch->bufs || !batch->caps || !batch->lens || !batch->outs) {
+        fprintf(stderr, "Memory allocation failed for stream buffers\n");
+        exit(1);
+    }
+    for (int i = batch->cap_pieces; i < pieces; i++) {
+        batch->bufs[i] = NULL;
+        batch->caps[i] = 0;
+        batch->lens[i] = 0;
+        batch->outs[i] = (OutBuf){0};
+    }
+    batch->cap_pieces = pieces;
+}
+
+static IoSlice* batch_slices(StreamBatch* batch, int count) {
+    if (count > batch->cap_slices) {
+        batch->slices = realloc(batch->slices, sizeof(IoSlice) * count);
+        if (!batch->slices) { fprintf(stderr, "Memory allocation failed for stream buffers\n"); exit(1); }
+        batch->cap_slices = count;
+    }
+    return batch->slices;
+}
+
+// Hand the chunks of outs[0..pieces) to the writer in order
+static void batch_write_outs(StreamIo* io, StreamBatch* batch, int pieces) {
+    int count = 0;
+    for (int p = 0; p < pieces; p++) {
+        for (const OutChunk* chunk = batch->outs[p].head; chunk; chunk = chunk->next) count++;
+    }
+    IoSlice* slices = batch_slices(batch, count);
+    count = 0;
+    for (int p = 0; p < pieces; p++) {
+        for (const OutChunk* chunk = batch->outs[p].head; chunk; chunk = chunk->next) {
+            if (chunk->len) slices[count++] = (IoSlice){ chunk->data, chunk->len };
+        }
+    }
+    stream_write_end(io);
+    stream_write_begin(io, slices, count);
+}
+
+static char* batch_buffer(StreamBatch* batch, int piece, size_t need) {
+    if (batch->caps[piece] < need) {
+        free(batch->bufs[piece]);
+        batch->bufs[piece] = malloc(need);
+        if (!batch->bufs[piece]) { fprintf(stderr, "Memory allocation failed for stream buffers\n"); exit(1); }
+        batch->caps[piece] = need;
+    }
+    return batch->bufs[piece];
+}
+
+static void batch_free(StreamBatch* batch) {
+    for (int i = 0; i < batch->cap_pieces; i++) {
+        free(batch->bufs[i]);
+        outbuf_release(&batch->outs[i]);
+    }
+    free(batch->bufs);
+    free(batch->caps);
+    free(batch->lens);
+    free(batch->outs);
+    free(batch->slices);
+}
+
+// Run `transform` over the input one window batch at a time: each batch of up to threads * window
+// bytes is cut after its last delimiter, split between the threads and transformed while the
+// next batch is read and the previous one written, so memory stays bounded whatever the input size.
+static void transform_stream(StreamIo* io, SpanTransform transform, char escape_char,
+                             const Dictionary* dict, int threads, size_t window) {
+    size_t capacity = window * threads;
+    char* inputs[2] = { malloc(capacity), malloc(capacity) };
+    StreamBatch batches[2];
+    memset(batches, 0, sizeof(batches));
+    size_t* split_points = malloc(sizeof(size_t) * (threads + 1));
+    if (!inputs[0] || !inputs[1] || !split_points) {
+        fprintf(stderr, "Memory allocation failed for stream buffers\n");
+        exit(1);
+    }
+    // Piece 0 carries bytes passed through untouched ahead of the transformed pieces 1..threads
+    batch_reserve(&batches[0], threads + 1);
+    batch_reserve(&batches[1], threads + 1);
+
+    size_t carry = 0;
+    bool eof = false;
+    // Set while we are inside a token longer than a whole batch; such a token can't be a
+    // dictionary word or symbol, so it is passed through untouched until its delimiter.
+    bool in_long_token = false;
+    int cur = 0;
+    stream_read_begin(io, inputs[cur], capacity);
+
+    while (true) {
+        char* input_buffer = inputs[cur];
+        StreamBatch* batch = &batches[cur];
+        size_t got = stream_read_end(io);
+        size_t have = carry + got;
+        if (got < capacity - carry) eof = true;
+        if (have == 0) break;
+
+        size_t start = 0;
+        size_t pass_skip = 0;
+        if (in_long_token) {
+            while (start < have && !is_delimiter(input_buffer[start])) start++;
+            if (start < have) in_long_token = false;
+        }
+
+        size_t cut = have;
+        if (!eof) {
+            while (cut > start && !is_delimiter(input_buffer[cut - 1])) cut--;
+            if (cut == 0) {
+                // A single token fills the whole batch: emit it raw (minus a decoder escape)
+                pass_skip = (transform == decompress_span && input_buffer[0] == escape_char) ? 1 : 0;
+                start = cut = have;
+                in_long_token = true;
+            }
+        }
+
+        // This batch's previous write finished before the last one began, so its chunks are free
+        for (int p = 0; p <= threads; p++) outbuf_release(&batch->outs[p]);
+        outbuf_append(&batch->outs[0], input_buffer + pass_skip, start - pass_skip);
+
+        carry = have - cut;
+        memcpy(inputs[cur ^ 1], input_buffer + cut, carry);
+        if (!eof) stream_read_begin(io, inputs[cur ^ 1] + carry, capacity - carry);
+
+        split_at_delimiters(input_buffer, start, cut, threads, split_points);
+
+        #pragma omp parallel num_threads(threads)
+        {
+            int tid = omp_get_thread_num();
+            outbuf_transform(&batch->outs[tid + 1], transform, input_buffer, split_points[tid], split_points[tid + 1],
+                             escape_char, dict);
+        }
+        batch_write_outs(io, batch, threads + 1);
+
+        if (eof && carry == 0) break;
+        cur ^= 1;
+    }
+    stream_write_end(io);
+
+    batch_free(&batches[0]);
+    batch_free(&batches[1]);
+    chunk_pool_drain();
+    free(split_points);
+    free(inputs[0]);
+    free(inputs[1]);
+}
+
+// Streaming counterpart of compress_framed(): each thread's piece of a window batch becomes
+// one block. No escape pre-pass is needed, so any readable stream works as input.
+static void compress_frame_stream(StreamIo* io, const Dictionary* dict, int threads, size_t window) {
+    size_t capacity = window * threads;
+    char* inputs[2] = { malloc(capacity), malloc(capacity) };
+    StreamBatch batches[2];
+    memset(batches, 0, sizeof(batches));
+    BlockInfo* pieces = calloc(threads, sizeof(BlockInfo));
+    size_t* split_points = malloc(sizeof(size_t) * (threads + 1));
+    size_t index_cap = 64, count = 0;
+    BlockInfo* blocks = malloc(sizeof(BlockInfo) * index_cap);
+    if (!inputs[0] || !inputs[1] || !pieces || !split_points || !blocks) {
+        fprintf(stderr, "Memory allocation failed for stream buffers\n");
+        exit(1);
+    }
+    batch_reserve(&batches[0], threads);
+    batch_reserve(&batches[1], threads);
+
+    write_frame_header(io->out);
+    uint64_t pos = FRAME_HEADER_SIZE;
+    size_t carry = 0;
+    bool eof = false;
+    int cur = 0;
+    stream_read_begin(io, inputs[cur], capacity);
+
+    while (!eof) {
+        char* input_buffer = inputs[cur];
+        StreamBatch* batch = &batches[cur];
+        size_t got = stream_read_end(io);
+        size_t have = carry + got;
+        if (got < capacity - carry) eof = true;
+        if (have == 0) break;
+
+        size_t cut = have;
+        if (!eof) {
+            while (cut > 0 && !is_delimiter(input_buffer[cut - 1])) cut--;
+            if (cut == 0) cut = have;
+        }
+        carry = have - cut;
+        memcpy(inputs[cur ^ 1], input_buffer + cut, carry);
+        if (!eof) stream_read_begin(io, inputs[cur ^ 1] + carry, capacity - carry);
+
+        split_at_delimiters(input_buffer, 0, cut, threads, split_points);
+
+        #pragma omp parallel num_threads(threads)
+        {
+            int tid = omp_get_thread_num();
+            OutBuf* piece = &batch->outs[tid];
+            outbuf_release(piece);
+            if (split_points[tid] < split_points[tid + 1]) {
+                compress_block(input_buffer, split_points[tid], split_points[tid + 1], dict, piece, &pieces[tid]);
+            } else {
+                pieces[tid].orig_len = 0;
+            }
+        }
+
+        for (int t = 0; t < threads; t++) {
+            if (pieces[t].orig_len == 0) continue;
+            if (count == index_cap) {
+                index_cap *= 2;
+                BlockInfo* grown = realloc(blocks, sizeof(BlockInfo) * index_cap);
+                if (!grown) { fprintf(stderr, "Memory allocation failed for block index\n"); exit(1); }
+                blocks = grown;
+            }
+            pieces[t].offset = pos;
+            blocks[count++] = pieces[t];
+            pos += BLOCK_HEADER_SIZE + pieces[t].comp_len;
+        }
+        batch_write_outs(io, batch, threads);
+
+        cur ^= 1;
+    }
+    stream_write_end(io);
+    write_frame_end(io->out, blocks, count, pos);
+
+    batch_free(&batches[0]);
+    batch_free(&batches[1]);
+    chunk_pool_drain();
+    free(pieces);
+    free(split_points);
+    free(blocks);
+    free(inputs[0]);
+    free(inputs[1]);
+}
+
+// Decode a framed container front to back without the index. Each read of about
+// threads * window bytes is parsed into whole blocks, which are decoded in parallel while
+// the next read and the previous write are in flight; a trailing partial block carries over.
+// The first byte of the header has already been consumed by the caller.
+static void decompress_frame_stream(StreamIo* io, const Dictionary* dict, int threads, size_t window) {
+    unsigned char header[FRAME_HEADER_SIZE];
+    header[0] = 0;
+    if (fread(header + 1, 1, FRAME_HEADER_SIZE - 1, io->in) != FRAME_HEADER_SIZE - 1 ||
+        memcmp(header, FRAME_MAGIC, 4) != 0) corrupt_container();
+    if (header[4] != FRAME_VERSION) {
+        fprintf(stderr, "Unsupported container version %d\n", header[4]);
+        exit(1);
+    }
+
+    size_t capacity = window * (threads + 1);
+    char* inputs[2] = { malloc(capacity), malloc(capacity) };
+    size_t input_caps[2] = { capacity, capacity };
+    StreamBatch batches[2];
+    memset(batches, 0, sizeof(batches));
+    int piece_cap = 0;
+    BlockInfo* pieces = NULL;
+    bool* ok = NULL;
+    if (!inputs[0] || !inputs[1]) {
+        fprintf(stderr, "Memory allocation failed for stream buffers\n");
+        exit(1);
+    }
+
+    size_t carry = 0;
+    bool eof = false;
+    bool done = false;
+    int cur = 0;
+    stream_read_begin(io, inputs[cur], capacity);
+
+    while (!done) {
+        char* input_buffer = inputs[cur];
+        StreamBatch* batch = &batches[cur];
+        size_t want = capacity - carry;
+        size_t got = stream_read_end(io);
+        size_t have = carry + got;
+        if (got < want) eof = true;
+
+        int n = 0;
+        size_t pos = 0;
+        size_t need = BLOCK_HEADER_SIZE;
+        while (have - pos >= BLOCK_HEADER_SIZE) {
+            const unsigned char* block_header = (const unsigned char*)input_buffer + pos;
+            char escape_char = (char)block_header[0];
+            uint32_t comp_len = get_u32(block_header + 1);
+            uint32_t orig_len = get_u32(block_header + 5);
+            if (!escape_char && !comp_len && !orig_len) {
+                done = true;
+                break;
+            }
+            if (orig_len > MAX_BLOCK_SIZE ||
+                comp_len > (uint64_t)MAX_BLOCK_SIZE * COMPRESS_EXPANSION + 1024) corrupt_container();
+            need = BLOCK_HEADER_SIZE + (size_t)comp_len;
+            if (have - pos < need) break;
+
+            if (n == piece_cap) {
+                piece_cap = piece_cap ? piece_cap * 2 : threads * 2;
+                pieces = realloc(pieces, sizeof(BlockInfo) * piece_cap);
+                ok = realloc(ok, sizeof(bool) * piece_cap);
+                if (!pieces || !ok) { fprintf(stderr, "Memory allocation failed for stream buffers\n"); exit(1); }
+            }
+            pieces[n].offset = pos + BLOCK_HEADER_SIZE;
+            pieces[n].escape_char = escape_char;
+            pieces[n].comp_len = comp_len;
+            pieces[n].orig_len = orig_len;
+            n++;
+            pos += need;
+            need = BLOCK_HEADER_SIZE;
+        }
+        if (!done && eof) corrupt_container();
+
+        // A block bigger than the read buffer grows the buffers before the next read
+        if (!done && need > capacity) capacity = need;
+        if (input_caps[cur ^ 1] < capacity) {
+            inputs[cur ^ 1] = realloc(inputs[cur ^ 1], capacity);
+            if (!inputs[cur ^ 1]) { fprintf(stderr, "Memory allocation failed for stream buffers\n"); exit(1); }
+            input_caps[cur ^ 1] = capacity;
+        }
+        carry = done ? 0 : have - pos;
+        memcpy(inputs[cur ^ 1], input_buffer + pos, carry);
+        if (!done) stream_read_begin(io, inputs[cur ^ 1] + carry, capacity - carry);
+
+        batch_reserve(batch, n);
+        #pragma omp parallel for num_threads(threads) schedule(dynamic)
+        for (int i = 0; i < n; i++) {
+            char* out = batch_buffer(batch, i, pieces[i].orig_len + 1);
+            ok[i] = decompress_block(input_buffer + pieces[i].offset, pieces[i].comp_len, pieces[i].orig_len,
+                                     pieces[i].escape_char, dict, out);
+        }
+
+        IoSlice* slices = batch_slices(batch, n);
+        for (int i = 0; i < n; i++) {
+            if (!ok[i]) corrupt_container();
+            slices[i] = (IoSlice){ batch->bufs[i], pieces[i].orig_len };
+        }
+        stream_write_end(io);
+        stream_write_begin(io, slices, n);
+
+        cur ^= 1;
+    }
+    // What follows is the block index and trailer, which a front-to-back reader doesn't need
+    stream_write_end(io);
+
+    batch_free(&batches[0]);
+    batch_free(&batches[1]);
+    free(pieces);
+    free(ok);
+    free(inputs[0]);
+    free(inputs[1]);
+}
+
+void compress_stream(const char* dict_path, const char* lang_path, const char* input_path,
+                     int threads, size_t window, bool framed, bool use_uring, const char* output_path) {
+    FILE* in = open_stream_input(input_path);
+    FILE* out = open_output(output_path, "compressed");
+    StreamIo io;
+    stream_io_init(&io, in, out, use_uring);
+
+    // The raw format's escape byte must be unused across the whole input, so take one
+    // bounded pass over it first and rewind.
+    char escape_char = 0;
+    if (!framed) {
+        bool used[256] = {0};
+        char* scan = malloc(window);
+        if (!scan) { fprintf(stderr, "Memory allocation failed for stream buffers\n"); exit(1); }
+        mark_used_chars(used, scan, 0);
+        size_t got;
+        while ((got = fread(scan, 1, window, in)) > 0) {
+            mark_used_chars(used, scan, got);
+        }
+        free(scan);
+        if (fseek(in, 0, SEEK_SET) != 0) {
+            fprintf(stderr, "Raw streaming compression needs a seekable input: %s\n", input_path);
+            exit(1);
+        }
+        escape_char = pick_unused_char(used);
+        if (!escape_char) { fprintf(stderr, "No escape character available\n"); exit(1); }
+    }
+
+    Dictionary dict = load_dictionary(dict_path, lang_path);
+
+    if (framed) {
+        compress_frame_stream(&io, &dict, threads, window);
+    } else {
+        fputc(escape_char, out);
+        transform_stream(&io, compress_span, escape_char, &dict, threads, window);
+    }
+
+    stream_io_close(&io);
+    close_output(out);
+    if (in != stdin) fclose(in);
+    free_dictionary(&dict);
+}
+
+void decompress_stream(const char* dict_path, const char* lang_path, const char* input_path,
+                       int threads, size_t window, bool use_uring, const char* output_path) {
+    FILE* in = open_stream_input(input_path);
+    FILE* out = open_output(output_path, "decompressed");
+    StreamIo io;
+    stream_io_init(&io, in, out, use_uring);
+
+    int escape = fgetc(in);
+    if (escape != EOF) {
+        Dictionary dict = load_dictionary(lang_path, dict_path);
+
+        if (escape == 0) {
+            decompress_frame_stream(&io, &dict, threads, window);
+        } else {
+            transform_stream(&io, decompress_span, (char)escape, &dict, threads, window);
+        }
+
+        free_dictionary(&dict);
+    }
+
+    stream_io_close(&io);
+    close_output(out);
+    if (in != stdin) fclose(in);
+}
+
+// Parse a byte count with an optional K/M/G suffix
+static size_t parse_size(const char* text) {
+    char* end = NULL;
+    unsigned long long value = strtoull(text, &end, 10);
+    switch (*end) {
+        case 'k': case 'K': value <<= 10; end++; break;
+        case 'm': case 'M': value <<= 20; end++; break;
+        case 'g': case 'G': value <<= 30; end++; break;
+    }
+    if (end == text || *end != '\0') {
+        fprintf(stderr, "Invalid size: %s\n", text);
+        exit(1);
+    }
+    return (size_t)value;
+}
+
+static void print_usage(const char* prog) {
+    fprintf(stderr, "Usage: %s [options] <-c|-d> <input_file> <dict_file> <lang_file> <threads> <output_file>\n", prog);
+    fprintf(stderr, "       %s --build-dict <dict_file> <lang_file> <image_file>\n", prog);
+    fprintf(stderr, "       %s --build-dict-header <dict_file> <lang_file> cx_default_dict.h\n", prog);
+    fprintf(stderr, "  -c:  compress\n");
+    fprintf(stderr, "  -d:  decompress\n");
+    fprintf(stderr, "  Use - as the input or output file for stdin or stdout; stdin input is always streamed.\n");
+    fprintf(stderr, "  <dict_file> may be an image from --build-dict, or \"default\" in builds with an embedded\n");
+    fprintf(stderr, "  dictionary; <lang_file> is then ignored.\n");
+    fprintf(stderr, "  <threads> may be \"auto\" to fit the thread count to the CPUs available and the input.\n");
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  --stream        process the input in bounded windows instead of loading it whole\n");
+    fprintf(stderr, "  --window=<n>    bytes per thread per streaming window (default 1M, K/M/G suffixes)\n");
+    fprintf(stderr, "  --block-size=<n> bytes per independently decodable block (default 1M)\n");
+    fprintf(stderr, "  --io-uring      overlap streaming reads and writes with the transform using io_uring\n");
+    fprintf(stderr, "  --raw           write the unframed single-escape format of earlier releases\n");
+    fprintf(stderr, "  --range=<off>:<len>  decompress only that byte range of the original data\n");
+    fprintf(stderr, "  --shm           share the compiled text dictionary with other processes on this host\n");
+    fprintf(stderr, "  --trie          compress by walking a trie of the dictionary while scanning each word\n");
+    fprintf(stderr, "  --stats         print dictionary lookup counts and the prefilter's false-positive rate\n");
+}
+
+int main(int argc, char* argv[]) {
+    bool stream = false;
+    bool use_uring = false;
+    bool framed = true;
+    size_t window = DEFAULT_WINDOW;
+    size_t block_size = DEFAULT_BLOCK_SIZE;
+    bool ranged = false;
+    uint64_t range_start = 0, range_len = UINT64_MAX;
+    bool build_dict = false;
+    bool build_header = false;
+    init_delimiter_scan();
+
+    int arg = 1;
+    while (arg < argc && strncmp(argv[arg], "--", 2) == 0) {
+        if (strcmp(argv[arg], "--stream") == 0) {
+            stream = true;
+        } else if (strncmp(argv[arg], "--window=", 9) == 0) {
+            window = parse_size(argv[arg] + 9);
+        } else if (strncmp(argv[arg], "--block-size=", 13) == 0) {
+            block_size = parse_size(argv[arg] + 13);
+        } else if (strcmp(argv[arg], "--io-uring") == 0) {
+            use_uring = true;
+        } else if (strcmp(argv[arg], "--raw") == 0) {
+            framed = false;
+        } else if (strcmp(argv[arg], "--shm") == 0) {
+            share_dictionaries = true;
+        } else if (strcmp(argv[arg], "--stats") == 0) {
+            print_stats = true;
+        } else if (strcmp(argv[arg], "--trie") == 0) {
+            use_trie = true;
+        } else if (strcmp(argv[arg], "--build-dict") == 0) {
+            build_dict = true;
+        } else if (strcmp(argv[arg], "--build-dict-header") == 0) {
+            build_dict = build_header = true;
+        } else if (strncmp(argv[arg], "--range=", 8) == 0) {
+            const char* colon = strchr(argv[arg] + 8, ':');
+            if (!colon) {
+                fprintf(stderr, "Invalid range: %s\n", argv[arg] + 8);
+                return 1;
+            }
+            char start_text[32];
+            size_t start_len = (size_t)(colon - (argv[arg] + 8));
+            if (start_len >= sizeof(start_text)) start_len = sizeof(start_text) - 1;
+            memcpy(start_text, argv[arg] + 8, start_len);
+            start_text[start_len] = '\0';
+            range_start = parse_size(start_text);
+            range_len = parse_size(colon + 1);
+            ranged = true;
+        } else {
+            fprintf(stderr, "Unknown option: %s\n", argv[arg]);
+            print_usage(argv[0]);
+            return 1;
+        }
+        arg++;
+    }
+
+    if (build_dict) {
+        if (argc - arg != 3) {
+            print_usage(argv[0]);
+            return 1;
+        }
+        build_dictionary_file(argv[arg], argv[arg + 1], argv[arg + 2], build_header);
+        return 0;
+    }
+
+    // Required arguments: mode, input, dict, lang, threads, output (6 total)
+    if (argc - arg != 6) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    const char* mode_flag = argv[arg];
+    const char* file_path = argv[arg + 1];
+    const char* dict_path = argv[arg + 2];
+    const char* language_path = argv[arg + 3];
+    int threads = atoi(argv[arg + 4]);
+    const char* output_path = argv[arg + 5];
+    if (strcmp(argv[arg + 4], "auto") == 0) {
+        auto_threads = true;
+        threads = available_cpus();
+    }
+    int cpus = threads;
+
+    if (threads < 1) {
+        fprintf(stderr, "Thread count must be at least 1\n");
+        return 1;
+    }
+    if (window < MIN_WINDOW) window = MIN_WINDOW;
+    if (window > MAX_BLOCK_SIZE / threads) window = MAX_BLOCK_SIZE / threads;
+    if (block_size < MIN_WINDOW) block_size = MIN_WINDOW;
+    if (block_size > MAX_BLOCK_SIZE / 2) block_size = MAX_BLOCK_SIZE / 2;
+
+    if (strcmp(mode_flag, "-c") != 0 && strcmp(mode_flag, "-d") != 0) {
+        fprintf(stderr, "Invalid mode\n");
+        return 1;
+    }
+
+    // A pipe can't be mapped or rewound, so stdin always goes through the streaming reader
+    if (is_std_stream(file_path)) stream = true;
+
+    if (ranged && (stream || mode_flag[1] != 'd')) {
+        fprintf(stderr, "--range only applies to in-memory decompression\n");
+        return 1;
+    }
+
+    if (stream) {
+        if (mode_flag[1] == 'c') {
+            compress_stream(dict_path, language_path, file_path, threads, window, framed, use_uring, output_path);
+        } else {
+            decompress_stream(language_path, dict_path, file_path, threads, window, use_uring, output_path);
+        }
+        if (print_stats && auto_threads) print_auto_threads(threads, cpus);
+        if (print_stats) print_transform_stats();
+        return 0;
+    }
+
+    InputFile input = open_input(file_path, "Input");
+
+    if (mode_flag[1] == 'c') {
+        if (framed) {
+            // Each thread compresses whole blocks, so there's no use for more threads than blocks
+            size_t blocks = (input.len + block_size - 1) / block_size;
+            if (auto_threads && (size_t)threads > blocks) threads = blocks ? (int)blocks : 1;
+            compress_framed(dict_path, language_path, input.data, input.len, threads, block_size, output_path);
+        } else {
+            compress(dict_path, language_path, input.data, input.len, threads, output_path);
+        }
+    } else if (is_framed(input.data, input.len)) {
+        decompress_framed(language_path, dict_path, input.data, input.len, threads, range_start, range_len, output_path);
+    } else if (ranged) {
+        fprintf(stderr, "--range needs a framed container; %s is in the raw format\n", file_path);
+        close_input(&input);
         return 1;
+    } else {
+        decompress(language_path, dict_path, input.data, input.len, threads, output_path);
     }
 
-    free(input_buffer);
+    close_input(&input);
+    if (print_stats && auto_threads) print_auto_threads(auto_threads_chosen ? auto_threads_chosen : threads, cpus);
+    if (print_stats) print_transform_stats();
     return 0;
 }